@@ -0,0 +1,154 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <limits>
+
+#include "base/kaldi-common.h"
+#include "base/kaldi-math.h"
+#include "lat/kaldi-lattice.h"
+#include "adaptive-beam.h"
+#include "ctc-blank-collapser.h"
+#include "soa-lattice.h"
+
+namespace kaldi {
+
+typedef LatticeArc::StateId StateId;
+typedef LatticeArc::Label Label;
+
+// Few distinct costs, so that many arcs have tied gaps, and two of them closer
+// than the rounding errors of PruneLattice() would need as a margin.
+static LatticeWeight RandomTiedWeight() {
+  static const BaseFloat kCosts[] = {0.0, 1e-5, 0.5};
+  return LatticeWeight(kCosts[RandInt(0, 2)], 0.0);
+}
+
+// Random output label: one of the blanks or a symbol in [1, max_label].
+static Label RandomLabel(const std::vector<Label>& blanks, Label max_label) {
+  if (RandInt(0, 2) == 0) return blanks[RandInt(0, blanks.size() - 1)];
+  return RandInt(1, max_label);
+}
+
+// Random lattice of num_frames frames, as produced by a decoder: the states of
+// each frame are numbered after those of the previous one, and all the arcs
+// go to the next frame.
+static void RandomFrameLattice(const std::vector<Label>& blanks,
+                               Label max_label, int32 num_frames,
+                               Lattice* lat) {
+  lat->DeleteStates();
+  std::vector<StateId> prev(1, lat->AddState()), next;
+  lat->SetStart(prev[0]);
+  for (int32 t = 0; t < num_frames; ++t) {
+    next.clear();
+    const int32 num_states = RandInt(1, 3);
+    for (int32 i = 0; i < num_states; ++i) next.push_back(lat->AddState());
+    for (size_t i = 0; i < std::max(prev.size(), next.size()); ++i) {
+      const Label label = RandomLabel(blanks, max_label);
+      lat->AddArc(prev[i % prev.size()],
+                  LatticeArc(label, label, RandomTiedWeight(),
+                             next[i % next.size()]));
+    }
+    for (size_t i = 0; i < prev.size(); ++i) {
+      const int32 num_arcs = RandInt(0, 2);
+      for (int32 a = 0; a < num_arcs; ++a) {
+        const Label label = RandomLabel(blanks, max_label);
+        lat->AddArc(prev[i], LatticeArc(label, label, RandomTiedWeight(),
+                                        next[RandInt(0, num_states - 1)]));
+      }
+    }
+    prev.swap(next);
+  }
+  for (size_t i = 0; i < prev.size(); ++i)
+    lat->SetFinal(prev[i], RandomTiedWeight());
+}
+
+// Random topology, for labels in [1, max_label] (max_label > 1).
+static CtcTopology RandomTopology(Label max_label) {
+  switch (RandInt(0, 3)) {
+    case 0: return CtcTopology(kCtcTopologyNoRepeat);
+    case 1: return CtcTopology(kCtcTopologyBlankOptional);
+    case 2: return CtcTopology(kCtcTopologyHmm2, max_label / 2);
+    default: return CtcTopology(kCtcTopologyCtc);
+  }
+}
+
+static size_t NumArcs(const Lattice& lat) {
+  size_t num_arcs = 0;
+  for (StateId s = 0; s < lat.NumStates(); ++s) num_arcs += lat.NumArcs(s);
+  return num_arcs;
+}
+
+// Pruning with the adaptive beam must give a collapsed lattice of at most
+// max_arcs arcs, even when many arcs are tied with the beam, and the beam
+// must be the largest gap that fits.
+void UnitTestAdaptiveBeam() {
+  const Label max_label = RandInt(2, 10);
+  const std::vector<Label> blanks(1, RandInt(1, max_label));
+  const CtcTopology topology = RandomTopology(max_label);
+  Lattice lat;
+  RandomFrameLattice(blanks, max_label, RandInt(1, 10), &lat);
+  std::vector<double> arc_gaps, final_gaps;
+  const double best = ComputeArcGaps(lat, &arc_gaps);
+  if (best == std::numeric_limits<double>::infinity()) return;
+  std::vector<double> gaps(arc_gaps);
+  std::sort(gaps.begin(), gaps.end());
+  gaps.erase(std::unique(gaps.begin(), gaps.end()), gaps.end());
+  while (gaps.back() == std::numeric_limits<double>::infinity())
+    gaps.pop_back();
+  // Sizes of the collapsed lattice for each gap: max_arcs is chosen so that
+  // at least the best paths fit.
+  std::vector<size_t> sizes(gaps.size());
+  size_t num_states;
+  for (size_t i = 0; i < gaps.size(); ++i) {
+    CountCTCBlankRemovalSize(lat, CtcBlankSet(blanks), topology, &arc_gaps,
+                             gaps[i], &num_states, &sizes[i]);
+  }
+  const size_t max_arcs = RandInt(sizes.front(), sizes.back() + 1);
+  const double beam = ComputeAdaptiveBeam(lat, CtcBlankSet(blanks), topology,
+                                          max_arcs, &arc_gaps, &final_gaps);
+  if (beam == std::numeric_limits<double>::infinity()) {
+    KALDI_ASSERT(sizes.back() <= max_arcs);
+    return;
+  }
+  const size_t i = std::find(gaps.begin(), gaps.end(), beam) - gaps.begin();
+  KALDI_ASSERT(i + 1 < gaps.size());
+  KALDI_ASSERT(sizes[i] <= max_arcs && sizes[i + 1] > max_arcs);
+  PruneLatticeByGaps(arc_gaps, final_gaps, beam, &lat);
+  size_t num_arcs;
+  CountCTCBlankRemovalSize(lat, CtcBlankSet(blanks), topology, NULL, 0.0,
+                           &num_states, &num_arcs);
+  KALDI_ASSERT(num_arcs == sizes[i]);
+  Lattice out;
+  DispatchingCtcBlankCollapser collapser(CtcBlankSet(blanks),
+                                         kCtcArcSortNone, topology);
+  collapser.Collapse(SoaLattice(lat), &out);
+  KALDI_ASSERT(NumArcs(out) == num_arcs);
+}
+
+}  // namespace kaldi
+
+int main() {
+  using namespace kaldi;
+  for (int i = 0; i < 1000; ++i) UnitTestAdaptiveBeam();
+  std::cout << "Test OK.\n";
+  return 0;
+}
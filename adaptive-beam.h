@@ -0,0 +1,217 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef ADAPTIVE_BEAM_H_
+#define ADAPTIVE_BEAM_H_
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "fstext/fstext-utils.h"
+#include "lat/kaldi-lattice.h"
+#include "ctc-blank-collapser.h"
+
+namespace kaldi {
+
+// Count the number of states and arcs of the lattice produced by
+// RemoveCTCBlankFromLattice() (i.e. by the collapsers of
+// ctc-blank-collapser.h), without building it.
+// Each state s of the composition is paired with the state of C reached
+// after its incoming arc (the blank state, or the state of its symbol), so
+// the number of output states of s is the number of distinct C states among
+// its incoming arcs, and each of them gets a copy of all the arcs leaving s.
+// Epsilon arcs keep the C states of their origin (see CtcArcKind for the arcs
+// of other topologies).
+// If arc_gaps is not NULL, only the arcs whose gap (see ComputeArcGaps) is
+// not greater than max_gap are considered, i.e. the counts are those of the
+// lattice pruned by PruneLatticeByGaps() with beam max_gap.
+// The input lattice must be topologically sorted.
+inline void CountCTCBlankRemovalSize(
+    const Lattice& inp, const CtcBlankSet& blanks, const CtcTopology& topology,
+    const std::vector<double>* arc_gaps, double max_gap,
+    size_t* num_states, size_t* num_arcs) {
+  typedef LatticeArc::StateId StateId;
+  typedef LatticeArc::Label Label;
+  *num_states = *num_arcs = 0;
+  if (inp.Start() == fst::kNoStateId) return;
+  std::vector<std::vector<Label> > cstates(inp.NumStates());
+  cstates[inp.Start()].push_back(0);
+  size_t a = 0;
+  for (StateId s = 0; s < inp.NumStates(); ++s) {
+    std::vector<Label>& cs = cstates[s];
+    std::sort(cs.begin(), cs.end());
+    cs.erase(std::unique(cs.begin(), cs.end()), cs.end());
+    *num_states += cs.size();
+    for (fst::ArcIterator<Lattice> aiter(inp, s); !aiter.Done();
+         aiter.Next(), ++a) {
+      if (cs.empty()) continue;
+      if (arc_gaps != NULL && (*arc_gaps)[a] > max_gap) continue;
+      const LatticeArc& arc = aiter.Value();
+      std::vector<Label>& ns = cstates[arc.nextstate];
+      Label key;
+      switch (topology.Classify(arc.olabel, blanks, &key)) {
+        case kCtcArcEpsilon:
+          ns.insert(ns.end(), cs.begin(), cs.end());
+          *num_arcs += cs.size();
+          break;
+        case kCtcArcLoop:
+          if (std::binary_search(cs.begin(), cs.end(), key)) {
+            ns.push_back(key);
+            ++*num_arcs;
+          }
+          break;
+        default:
+          ns.push_back(key);
+          *num_arcs += cs.size();
+      }
+    }
+    std::vector<Label>().swap(cs);
+  }
+}
+
+// Total cost of a lattice weight.
+inline double LatticeCost(const LatticeWeight& w) {
+  return static_cast<double>(w.Value1()) + static_cast<double>(w.Value2());
+}
+
+// For each arc of the topologically sorted lattice (in state order and then
+// arc order), compute the difference between the cost of the best path
+// through the arc and the cost of the best path, i.e. the smallest beam for
+// which PruneLattice() keeps the arc. If final_gaps is not NULL, it receives
+// the same for the final weight of each state (infinity if it is not final).
+// Returns the cost of the best path (infinity if there is none).
+inline double ComputeArcGaps(const Lattice& lat, std::vector<double>* arc_gaps,
+                             std::vector<double>* final_gaps = NULL) {
+  typedef LatticeArc::StateId StateId;
+  const double inf = std::numeric_limits<double>::infinity();
+  const StateId num_states = lat.NumStates();
+  std::vector<double> alpha(num_states, inf), beta(num_states, inf);
+  arc_gaps->clear();
+  if (final_gaps != NULL) final_gaps->assign(num_states, inf);
+  if (lat.Start() == fst::kNoStateId) return inf;
+  alpha[lat.Start()] = 0.0;
+  for (StateId s = 0; s < num_states; ++s) {
+    if (alpha[s] == inf) continue;
+    for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+         aiter.Next()) {
+      const LatticeArc& arc = aiter.Value();
+      const double c = alpha[s] + LatticeCost(arc.weight);
+      if (c < alpha[arc.nextstate]) alpha[arc.nextstate] = c;
+    }
+  }
+  for (StateId s = num_states - 1; s >= 0; --s) {
+    double b = LatticeCost(lat.Final(s));
+    for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+         aiter.Next()) {
+      const LatticeArc& arc = aiter.Value();
+      b = std::min(b, LatticeCost(arc.weight) + beta[arc.nextstate]);
+    }
+    beta[s] = b;
+  }
+  const double best = beta[lat.Start()];
+  for (StateId s = 0; s < num_states; ++s) {
+    if (final_gaps != NULL)
+      (*final_gaps)[s] = alpha[s] + LatticeCost(lat.Final(s)) - best;
+    for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+         aiter.Next()) {
+      const LatticeArc& arc = aiter.Value();
+      arc_gaps->push_back(
+          alpha[s] + LatticeCost(arc.weight) + beta[arc.nextstate] - best);
+    }
+  }
+  return best;
+}
+
+// Find the largest pruning beam such that the lattice produced by
+// RemoveCTCBlankFromLattice() on the input pruned by PruneLatticeByGaps() has
+// at most max_arcs arcs. This is a binary search over the arc gaps of the
+// input lattice, which must be topologically sorted. The beam is one of the
+// gaps, so the arcs tied with it are either all kept or all pruned, according
+// to their count; if even the arcs of the best paths (the smallest gap) do
+// not fit, the smallest gap is returned.
+// The gaps of the arcs and final weights (see ComputeArcGaps()) are returned
+// in arc_gaps and final_gaps, for PruneLatticeByGaps().
+// Returns infinity if the whole lattice fits within max_arcs.
+inline double ComputeAdaptiveBeam(
+    const Lattice& lat, const CtcBlankSet& blanks,
+    const CtcTopology& topology, size_t max_arcs,
+    std::vector<double>* arc_gaps, std::vector<double>* final_gaps) {
+  const double inf = std::numeric_limits<double>::infinity();
+  if (ComputeArcGaps(lat, arc_gaps, final_gaps) == inf) return inf;
+  std::vector<double> beams;
+  for (double g : *arc_gaps) if (g != inf) beams.push_back(g);
+  std::sort(beams.begin(), beams.end());
+  beams.erase(std::unique(beams.begin(), beams.end()), beams.end());
+  if (beams.empty()) return inf;
+  size_t num_states = 0, num_arcs = 0;
+  CountCTCBlankRemovalSize(lat, blanks, topology, arc_gaps, beams.back(),
+                           &num_states, &num_arcs);
+  if (num_arcs <= max_arcs) return inf;
+  // Invariant: beams[lo] fits (or lo == 0), beams[hi] does not fit.
+  size_t lo = 0, hi = beams.size() - 1;
+  while (hi - lo > 1) {
+    const size_t mid = lo + (hi - lo) / 2;
+    CountCTCBlankRemovalSize(lat, blanks, topology, arc_gaps, beams[mid],
+                             &num_states, &num_arcs);
+    if (num_arcs <= max_arcs) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return beams[lo];
+}
+
+// Prune the lattice with the gaps computed by ComputeArcGaps() on it: keep
+// the arcs and final weights whose gap is not greater than beam, and remove
+// the states that are no longer on a successful path. These are exactly the
+// arcs counted by CountCTCBlankRemovalSize() with the same gaps, whereas
+// PruneLattice() recomputes the costs (in a different order, and so with
+// different rounding errors) and could keep other arcs tied with the beam.
+inline void PruneLatticeByGaps(const std::vector<double>& arc_gaps,
+                               const std::vector<double>& final_gaps,
+                               double beam, Lattice* lat) {
+  typedef LatticeArc::StateId StateId;
+  KALDI_ASSERT(final_gaps.size() == static_cast<size_t>(lat->NumStates()));
+  std::vector<LatticeArc> arcs;
+  size_t a = 0;
+  for (StateId s = 0; s < lat->NumStates(); ++s) {
+    if (final_gaps[s] > beam) lat->SetFinal(s, LatticeWeight::Zero());
+    arcs.clear();
+    for (fst::ArcIterator<Lattice> aiter(*lat, s); !aiter.Done();
+         aiter.Next(), ++a) {
+      if (arc_gaps[a] <= beam) arcs.push_back(aiter.Value());
+    }
+    if (arcs.size() != lat->NumArcs(s)) {
+      lat->DeleteArcs(s);
+      for (size_t k = 0; k < arcs.size(); ++k) lat->AddArc(s, arcs[k]);
+    }
+  }
+  KALDI_ASSERT(a == arc_gaps.size());
+  fst::Connect(lat);
+}
+
+}  // namespace kaldi
+
+#endif  // ADAPTIVE_BEAM_H_
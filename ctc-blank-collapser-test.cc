@@ -0,0 +1,578 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <sstream>
+
+#include "base/kaldi-common.h"
+#include "base/kaldi-math.h"
+#include "lat/kaldi-lattice.h"
+#include "ctc-blank-collapser.h"
+#include "grid-lattice.h"
+#include "parallel-ctc-blank-collapser.h"
+
+namespace kaldi {
+
+typedef LatticeArc::StateId StateId;
+typedef LatticeArc::Label Label;
+
+static const CtcArcSort kSortTypes[] = {
+  kCtcArcSortNone, kCtcArcSortILabel, kCtcArcSortOLabel
+};
+
+static bool StatesEqual(const Lattice& a, StateId sa, const Lattice& b,
+                        StateId sb) {
+  if (a.Final(sa) != b.Final(sb) || a.NumArcs(sa) != b.NumArcs(sb))
+    return false;
+  fst::ArcIterator<Lattice> aiter(a, sa), biter(b, sb);
+  for (; !aiter.Done(); aiter.Next(), biter.Next()) {
+    const LatticeArc& x = aiter.Value(), &y = biter.Value();
+    if (x.ilabel != y.ilabel || x.olabel != y.olabel ||
+        x.nextstate != y.nextstate || x.weight != y.weight)
+      return false;
+  }
+  return true;
+}
+
+// Whether the lattices are identical, state by state and arc by arc.
+static bool LatticesEqual(const Lattice& a, const Lattice& b) {
+  if (a.NumStates() != b.NumStates() || a.Start() != b.Start()) return false;
+  for (StateId s = 0; s < a.NumStates(); ++s)
+    if (!StatesEqual(a, s, b, s)) return false;
+  return true;
+}
+
+static LatticeWeight RandomWeight() {
+  return LatticeWeight(RandInt(0, 10) * 0.5, RandInt(0, 10) * 0.25);
+}
+
+// Random output label: one of the blanks or a symbol in [1, max_label].
+static Label RandomLabel(const std::vector<Label>& blanks, Label max_label) {
+  if (RandInt(0, 2) == 0) return blanks[RandInt(0, blanks.size() - 1)];
+  return RandInt(1, max_label);
+}
+
+// Random blanks in [1, max_label].
+static std::vector<Label> RandomBlanks(Label max_label) {
+  std::vector<Label> blanks(RandInt(1, 3));
+  for (size_t i = 0; i < blanks.size(); ++i)
+    blanks[i] = RandInt(1, max_label);
+  return blanks;
+}
+
+// Random lattice of num_frames frames, as produced by a decoder: the states of
+// each frame (frame_states[t]) are numbered after those of the previous one,
+// all the arcs go to the next frame and all the states are accessible.
+static void RandomFrameLattice(
+    const std::vector<Label>& blanks, Label max_label, int32 num_frames,
+    Lattice* lat, std::vector<std::vector<StateId> >* frame_states) {
+  lat->DeleteStates();
+  frame_states->assign(num_frames + 1, std::vector<StateId>());
+  lat->SetStart(lat->AddState());
+  (*frame_states)[0].push_back(lat->Start());
+  for (int32 t = 0; t < num_frames; ++t) {
+    const std::vector<StateId>& prev = (*frame_states)[t];
+    std::vector<StateId>& next = (*frame_states)[t + 1];
+    const int32 num_states = RandInt(1, 3);
+    for (int32 i = 0; i < num_states; ++i) next.push_back(lat->AddState());
+    for (size_t i = 0; i < std::max(prev.size(), next.size()); ++i) {
+      const Label label = RandomLabel(blanks, max_label);
+      lat->AddArc(prev[i % prev.size()],
+                  LatticeArc(label, label, RandomWeight(),
+                             next[i % next.size()]));
+    }
+    for (size_t i = 0; i < prev.size(); ++i) {
+      const int32 num_arcs = RandInt(0, 2);
+      for (int32 a = 0; a < num_arcs; ++a) {
+        const Label label = RandomLabel(blanks, max_label);
+        lat->AddArc(prev[i], LatticeArc(label, label, RandomWeight(),
+                                        next[RandInt(0, num_states - 1)]));
+      }
+    }
+  }
+  const std::vector<StateId>& last = (*frame_states)[num_frames];
+  for (size_t i = 0; i < last.size(); ++i)
+    lat->SetFinal(last[i], RandomWeight());
+}
+
+// Random topologically sorted lattice, with arcs to the next few states.
+// Some arcs have epsilon output labels if epsilons is true, and if
+// inaccessible is true, state 1 is not reached from the start.
+static void RandomLattice(const std::vector<Label>& blanks, Label max_label,
+                          bool epsilons, bool inaccessible, Lattice* lat) {
+  lat->DeleteStates();
+  const StateId num_states = RandInt(3, 12);
+  for (StateId s = 0; s < num_states; ++s) lat->AddState();
+  lat->SetStart(0);
+  for (StateId s = 0; s + 1 < num_states; ++s) {
+    const int32 num_arcs = RandInt(1, 3);
+    for (int32 a = 0; a < num_arcs; ++a) {
+      StateId n = s + RandInt(1, std::min<StateId>(3, num_states - 1 - s));
+      if (s == 0 && inaccessible && n == 1) n = 2;
+      Label label = RandomLabel(blanks, max_label);
+      if (epsilons && RandInt(0, 4) == 0) label = 0;
+      lat->AddArc(s, LatticeArc(label, label, RandomWeight(), n));
+    }
+    if (RandInt(0, 5) == 0) lat->SetFinal(s, RandomWeight());
+  }
+  lat->SetFinal(num_states - 1, RandomWeight());
+}
+
+// Whether the lattice has epsilon arcs or inaccessible states with arcs,
+// which the parallel collapser leaves to the sequential one.
+static bool NeedsSequentialCollapser(const Lattice& lat) {
+  std::vector<bool> accessible(lat.NumStates(), false);
+  accessible[lat.Start()] = true;
+  for (StateId s = 0; s < lat.NumStates(); ++s) {
+    for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+         aiter.Next()) {
+      if (aiter.Value().olabel == 0 || !accessible[s]) return true;
+      accessible[aiter.Value().nextstate] = true;
+    }
+  }
+  return false;
+}
+
+// Transducer C of the standard CTC topology, for the given blanks and the
+// symbols in [1, max_label], built as the original version of the tool did:
+// state q is reached after reading symbol q, and state 0 after a blank.
+static void BuildCtcTransducer(const CtcBlankSet& blanks, Label max_label,
+                               Lattice* C) {
+  C->DeleteStates();
+  for (Label q = 0; q <= max_label; ++q)
+    C->SetFinal(C->AddState(), LatticeWeight::One());
+  C->SetStart(0);
+  for (Label q = 0; q <= max_label; ++q) {
+    for (Label l = 1; l <= max_label; ++l) {
+      if (blanks.IsBlank(l)) {
+        C->AddArc(q, LatticeArc(l, 0, LatticeWeight::One(), 0));
+      } else if (l == q) {
+        C->AddArc(q, LatticeArc(l, 0, LatticeWeight::One(), q));
+      } else {
+        C->AddArc(q, LatticeArc(l, l, LatticeWeight::One(), l));
+      }
+    }
+  }
+}
+
+// A successful path of a lattice: its input labels, its output labels
+// (without epsilons) and its weight.
+struct LatticePath {
+  std::vector<Label> ilabels, olabels;
+  LatticeWeight weight;
+
+  bool operator<(const LatticePath& other) const {
+    if (ilabels != other.ilabels) return ilabels < other.ilabels;
+    if (olabels != other.olabels) return olabels < other.olabels;
+    if (weight.Value1() != other.weight.Value1())
+      return weight.Value1() < other.weight.Value1();
+    return weight.Value2() < other.weight.Value2();
+  }
+  bool operator==(const LatticePath& other) const {
+    return ilabels == other.ilabels && olabels == other.olabels &&
+        weight == other.weight;
+  }
+};
+
+static void GetPaths(const Lattice& lat, StateId s, LatticePath* path,
+                     std::vector<LatticePath>* paths) {
+  if (lat.Final(s) != LatticeWeight::Zero()) {
+    paths->push_back(*path);
+    paths->back().weight = fst::Times(path->weight, lat.Final(s));
+  }
+  for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done(); aiter.Next()) {
+    const LatticeArc& arc = aiter.Value();
+    const LatticeWeight weight = path->weight;
+    path->ilabels.push_back(arc.ilabel);
+    if (arc.olabel != 0) path->olabels.push_back(arc.olabel);
+    path->weight = fst::Times(weight, arc.weight);
+    GetPaths(lat, arc.nextstate, path, paths);
+    path->ilabels.pop_back();
+    if (arc.olabel != 0) path->olabels.pop_back();
+    path->weight = weight;
+  }
+}
+
+// All the successful paths of the acyclic lattice, sorted.
+static void GetSortedPaths(const Lattice& lat,
+                           std::vector<LatticePath>* paths) {
+  paths->clear();
+  if (lat.Start() == fst::kNoStateId) return;
+  LatticePath path;
+  path.weight = LatticeWeight::One();
+  GetPaths(lat, lat.Start(), &path, paths);
+  std::sort(paths->begin(), paths->end());
+}
+
+// The collapser must give the same result as the composition with the
+// transducer C of the original version of the tool: since C is
+// deterministic on its input, both have one path for each path of the input,
+// with the same alignment, transcription and weight.
+void UnitTestCollapseMatchesComposition() {
+  const Label max_label = RandInt(2, 20);
+  const CtcBlankSet blanks(RandomBlanks(max_label));
+  Lattice lat;
+  RandomLattice(blanks.Labels(), max_label, RandInt(0, 1) == 0,
+                RandInt(0, 3) == 0, &lat);
+  Lattice C, composed;
+  BuildCtcTransducer(blanks, max_label, &C);
+  fst::ArcSort(&C, fst::ILabelCompare<LatticeArc>());
+  fst::Compose(lat, C, &composed);
+  Lattice out;
+  DispatchingCtcBlankCollapser collapser(blanks, kSortTypes[RandInt(0, 2)]);
+  collapser.Collapse(SoaLattice(lat), &out);
+  std::vector<LatticePath> expected_paths, paths;
+  GetSortedPaths(composed, &expected_paths);
+  GetSortedPaths(out, &paths);
+  KALDI_ASSERT(paths == expected_paths);
+}
+
+// Parse a sequence of labels separated by spaces.
+static std::vector<Label> ParseLabels(const std::string& str) {
+  std::istringstream is(str);
+  std::vector<Label> labels;
+  Label label;
+  while (is >> label) labels.push_back(label);
+  return labels;
+}
+
+// Collapse the linear lattice of the given frame-level symbols (one per
+// frame) and check that it has a single successful path, whose transcription
+// is the given one, or no successful path if expected is NULL.
+static void AssertCollapsedTranscription(const CtcTopology& topology,
+                                         const char* frames,
+                                         const char* expected) {
+  const CtcBlankSet blanks(std::vector<Label>(1, 5));
+  const std::vector<Label> symbols = ParseLabels(frames);
+  Lattice lat;
+  lat.AddState();
+  lat.SetStart(0);
+  for (size_t t = 0; t < symbols.size(); ++t) {
+    lat.AddState();
+    lat.AddArc(t, LatticeArc(t + 1, symbols[t], RandomWeight(), t + 1));
+  }
+  lat.SetFinal(symbols.size(), RandomWeight());
+  Lattice out;
+  DispatchingCtcBlankCollapser collapser(blanks, kSortTypes[RandInt(0, 2)],
+                                         topology);
+  collapser.Collapse(SoaLattice(lat), &out);
+  std::vector<LatticePath> paths, input_paths;
+  GetSortedPaths(out, &paths);
+  if (expected == NULL) {
+    KALDI_ASSERT(paths.empty());
+    return;
+  }
+  GetSortedPaths(lat, &input_paths);
+  KALDI_ASSERT(paths.size() == 1);
+  KALDI_ASSERT(paths[0].ilabels == input_paths[0].ilabels);
+  KALDI_ASSERT(paths[0].weight == input_paths[0].weight);
+  KALDI_ASSERT(paths[0].olabels == ParseLabels(expected));
+}
+
+// Hand-written examples of each topology, with blank 5: repeated symbols with
+// and without blanks between them, and leading and trailing blanks.
+void UnitTestCtcTopologies() {
+  const CtcTopology ctc(kCtcTopologyCtc);
+  AssertCollapsedTranscription(ctc, "1 1 2", "1 2");
+  AssertCollapsedTranscription(ctc, "1 5 1", "1 1");
+  AssertCollapsedTranscription(ctc, "5 1 1 5", "1");
+  AssertCollapsedTranscription(ctc, "5 5 2 5 2 2 1 5", "2 2 1");
+  AssertCollapsedTranscription(ctc, "5 5", "");
+
+  const CtcTopology no_repeat(kCtcTopologyNoRepeat);
+  AssertCollapsedTranscription(no_repeat, "1 1 2", "1 1 2");
+  AssertCollapsedTranscription(no_repeat, "1 5 1", "1 1");
+  AssertCollapsedTranscription(no_repeat, "5 1 5", "1");
+  AssertCollapsedTranscription(no_repeat, "5 2 2 5 5", "2 2");
+
+  const CtcTopology blank_optional(kCtcTopologyBlankOptional);
+  AssertCollapsedTranscription(blank_optional, "1 1 2", "1 2");
+  AssertCollapsedTranscription(blank_optional, "1 5 1", "1");
+  AssertCollapsedTranscription(blank_optional, "5 1 5 2 5", "1 2");
+  AssertCollapsedTranscription(blank_optional, "1 5 2 5 1 1", "1 2 1");
+  AssertCollapsedTranscription(blank_optional, "5", "");
+
+  // The loop label of symbol l is l + 10.
+  const CtcTopology hmm2(kCtcTopologyHmm2, 10);
+  AssertCollapsedTranscription(hmm2, "1 11 11 2", "1 2");
+  AssertCollapsedTranscription(hmm2, "1 1", "1 1");
+  AssertCollapsedTranscription(hmm2, "5 1 11 5 1 5", "1 1");
+  AssertCollapsedTranscription(hmm2, "5 2 12 5", "2");
+  // Loops after a blank or after a different symbol are not allowed.
+  AssertCollapsedTranscription(hmm2, "1 5 11", NULL);
+  AssertCollapsedTranscription(hmm2, "2 11", NULL);
+  AssertCollapsedTranscription(hmm2, "11", NULL);
+}
+
+// The parallel collapser must give the same lattice as the sequential one,
+// state by state, for any number of threads, and leave the lattices with
+// epsilon arcs or inaccessible states to the sequential collapser.
+void UnitTestParallelCtcBlankCollapser() {
+  const Label max_label = RandInt(2, 20);
+  const CtcBlankSet blanks(RandomBlanks(max_label));
+  const bool epsilons = (RandInt(0, 3) == 0);
+  const bool inaccessible = (RandInt(0, 3) == 0);
+  Lattice lat;
+  RandomLattice(blanks.Labels(), max_label, epsilons, inaccessible, &lat);
+  const SoaLattice inp(lat);
+  const bool sequential = NeedsSequentialCollapser(lat);
+  for (size_t t = 0; t < sizeof(kSortTypes) / sizeof(kSortTypes[0]); ++t) {
+    Lattice expected;
+    DispatchingCtcBlankCollapser collapser(blanks, kSortTypes[t]);
+    collapser.Collapse(inp, &expected);
+    for (int32 num_threads = 1; num_threads <= 4; ++num_threads) {
+      ParallelCtcBlankCollapser parallel(blanks, num_threads, kSortTypes[t]);
+      Lattice out;
+      out.AddState();
+      const bool collapsed = parallel.Collapse(inp, &out);
+      KALDI_ASSERT(collapsed == !sequential);
+      if (collapsed) {
+        KALDI_ASSERT(LatticesEqual(out, expected));
+      } else {
+        KALDI_ASSERT(out.NumStates() == 1);
+      }
+    }
+  }
+}
+
+// Random topology, for labels in [1, max_label] (max_label > 1).
+static CtcTopology RandomTopology(Label max_label) {
+  switch (RandInt(0, 3)) {
+    case 0: return CtcTopology(kCtcTopologyNoRepeat);
+    case 1: return CtcTopology(kCtcTopologyBlankOptional);
+    case 2: return CtcTopology(kCtcTopologyHmm2, max_label / 2);
+    default: return CtcTopology(kCtcTopologyCtc);
+  }
+}
+
+// Collapse inp with the collapser of the given representation of the states
+// of C, and the given compaction of the labels (if not NULL).
+template <class LabelSet>
+static void CollapseWith(const SoaLattice& inp, const CtcBlankSet& blanks,
+                         CtcArcSort sort, const CtcTopology& topology,
+                         const CtcLabelCompaction* compaction, Lattice* out) {
+  CtcBlankCollapserTpl<LabelSet> collapser(blanks, sort, topology);
+  collapser.Init(&inp, out, compaction);
+  collapser.Finish();
+}
+
+// The collapsers with each bitset width, and the one chosen by
+// DispatchingCtcBlankCollapser, must give the same lattice as the one with
+// CtcLabelVector, state by state.
+void UnitTestCtcLabelBitsets() {
+  static const Label kMaxLabels[] = { 20, 127, 255, 1023 };
+  const Label max_label = kMaxLabels[RandInt(0, 3)];
+  const CtcBlankSet blanks(RandomBlanks(max_label));
+  const CtcTopology topology = RandomTopology(max_label);
+  Lattice lat;
+  RandomLattice(blanks.Labels(), max_label, RandInt(0, 1) == 0, false, &lat);
+  const SoaLattice inp(lat);
+  for (size_t t = 0; t < sizeof(kSortTypes) / sizeof(kSortTypes[0]); ++t) {
+    const CtcArcSort sort = kSortTypes[t];
+    Lattice expected, out;
+    CollapseWith<CtcLabelVector>(inp, blanks, sort, topology, NULL,
+                                 &expected);
+    if (max_label < 128) {
+      CollapseWith<CtcLabelBitset<128> >(inp, blanks, sort, topology, NULL,
+                                         &out);
+      KALDI_ASSERT(LatticesEqual(out, expected));
+    }
+    if (max_label < 256) {
+      CollapseWith<CtcLabelBitset<256> >(inp, blanks, sort, topology, NULL,
+                                         &out);
+      KALDI_ASSERT(LatticesEqual(out, expected));
+    }
+    CollapseWith<CtcLabelBitset<1024> >(inp, blanks, sort, topology, NULL,
+                                        &out);
+    KALDI_ASSERT(LatticesEqual(out, expected));
+    DispatchingCtcBlankCollapser collapser(blanks, sort, topology);
+    collapser.Collapse(inp, &out);
+    KALDI_ASSERT(LatticesEqual(out, expected));
+  }
+}
+
+// Multiply all the labels of the lattice by factor (e.g. to give them sparse
+// ids of a large symbol table).
+static void ScaleLabels(Label factor, Lattice* lat) {
+  for (StateId s = 0; s < lat->NumStates(); ++s) {
+    for (fst::MutableArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+         aiter.Next()) {
+      LatticeArc arc = aiter.Value();
+      arc.ilabel *= factor;
+      arc.olabel *= factor;
+      aiter.SetValue(arc);
+    }
+  }
+}
+
+// Lattices with large but few distinct labels are collapsed with compacted
+// labels (see CtcLabelCompaction), which must give the same lattice as the
+// collapser with CtcLabelVector on the original labels, state by state.
+void UnitTestCtcLabelCompaction() {
+  const Label max_label = RandInt(20, 200), factor = 1000;
+  std::vector<Label> blank_labels = RandomBlanks(max_label);
+  const CtcTopology topology = RandomTopology(max_label);
+  Lattice lat;
+  RandomLattice(blank_labels, max_label, RandInt(0, 1) == 0, false, &lat);
+  ScaleLabels(factor, &lat);
+  for (size_t i = 0; i < blank_labels.size(); ++i) blank_labels[i] *= factor;
+  const CtcBlankSet blanks(blank_labels);
+  const CtcTopology scaled_topology(topology.Type(),
+                                    topology.LoopOffset() * factor);
+  const SoaLattice inp(lat);
+  CtcLabelCompaction compaction;
+  KALDI_ASSERT(compaction.Init(inp, blanks, scaled_topology, 1023));
+  const Label num_labels = compaction.NumLabels();
+  KALDI_ASSERT(num_labels <= max_label);
+  if (num_labels > 0) {
+    KALDI_ASSERT(!compaction.Init(inp, blanks, scaled_topology,
+                                  num_labels - 1));
+  }
+  KALDI_ASSERT(compaction.Init(inp, blanks, scaled_topology, num_labels));
+  for (size_t t = 0; t < sizeof(kSortTypes) / sizeof(kSortTypes[0]); ++t) {
+    const CtcArcSort sort = kSortTypes[t];
+    Lattice expected, out;
+    CollapseWith<CtcLabelVector>(inp, blanks, sort, scaled_topology, NULL,
+                                 &expected);
+    CollapseWith<CtcLabelBitset<256> >(inp, blanks, sort, scaled_topology,
+                                       &compaction, &out);
+    KALDI_ASSERT(LatticesEqual(out, expected));
+    DispatchingCtcBlankCollapser collapser(blanks, sort, scaled_topology);
+    collapser.Collapse(inp, &out);
+    KALDI_ASSERT(LatticesEqual(out, expected));
+  }
+}
+
+// Random grid lattice (see GridLattice) of distinct labels in [1, max_label].
+static void RandomGridLattice(Label max_label, Lattice* lat) {
+  std::vector<Label> labels;
+  for (Label l = 1; l <= max_label; ++l)
+    if (RandInt(0, 1) == 0) labels.push_back(l);
+  if (labels.empty()) labels.push_back(RandInt(1, max_label));
+  lat->DeleteStates();
+  const int32 num_frames = RandInt(1, 8);
+  for (int32 t = 0; t <= num_frames; ++t) lat->AddState();
+  lat->SetStart(0);
+  for (int32 t = 0; t < num_frames; ++t) {
+    for (size_t v = 0; v < labels.size(); ++v) {
+      lat->AddArc(t, LatticeArc(labels[v], labels[v],
+                                LatticeWeight(RandUniform() * 3,
+                                              RandUniform() * 3),
+                                t + 1));
+    }
+  }
+  lat->SetFinal(num_frames, RandomWeight());
+}
+
+// The grid collapser must give the same lattice as the generic collapser on
+// the pruned lattice, state by state, and CountGridCollapsedSize() its size.
+void UnitTestCollapseGridLattice() {
+  const Label max_label = RandInt(1, 10);
+  const CtcBlankSet blanks(RandomBlanks(max_label));
+  Lattice lat;
+  RandomGridLattice(max_label, &lat);
+  GridLattice grid;
+  KALDI_ASSERT(grid.Init(lat));
+  const BaseFloat beam = (RandInt(0, 1) == 0 ? 1.0 + RandUniform() * 3 : 100.0);
+  KALDI_ASSERT(grid.Prune(beam));
+  KALDI_ASSERT(PruneGridLattice(beam, &lat));
+  for (size_t t = 0; t < sizeof(kSortTypes) / sizeof(kSortTypes[0]); ++t) {
+    Lattice expected, out;
+    DispatchingCtcBlankCollapser collapser(blanks, kSortTypes[t]);
+    collapser.Collapse(SoaLattice(lat), &expected);
+    CollapseGridLattice(grid, blanks, kSortTypes[t], &out);
+    KALDI_ASSERT(LatticesEqual(out, expected));
+    size_t num_states = 0, num_arcs = 0, expected_arcs = 0;
+    CountGridCollapsedSize(grid, blanks, &num_states, &num_arcs);
+    for (StateId s = 0; s < expected.NumStates(); ++s)
+      expected_arcs += expected.NumArcs(s);
+    KALDI_ASSERT(num_states == static_cast<size_t>(expected.NumStates()));
+    KALDI_ASSERT(num_arcs == expected_arcs);
+  }
+}
+
+// The online collapser, fed frame by frame, must give the same lattice as
+// the collapse of the whole input, and at each frame its output must hold
+// the partial hypotheses: the states either have their final arcs, or none
+// and are final with weight One.
+void UnitTestOnlineCtcBlankCollapser() {
+  const Label max_label = RandInt(2, 20);
+  const CtcBlankSet blanks(RandomBlanks(max_label));
+  const int32 num_frames = RandInt(1, 15);
+  Lattice full;
+  std::vector<std::vector<StateId> > frame_states;
+  RandomFrameLattice(blanks.Labels(), max_label, num_frames, &full,
+                     &frame_states);
+  Lattice expected;
+  DispatchingCtcBlankCollapser collapser(blanks);
+  collapser.Collapse(SoaLattice(full), &expected);
+
+  OnlineCtcBlankCollapser online(blanks);
+  Lattice* inp = online.InputLattice();
+  inp->SetStart(inp->AddState());
+  for (int32 t = 0; t < num_frames; ++t) {
+    const std::vector<StateId>& prev = frame_states[t];
+    for (size_t i = 0; i < frame_states[t + 1].size(); ++i) inp->AddState();
+    for (size_t i = 0; i < prev.size(); ++i) {
+      for (fst::ArcIterator<Lattice> aiter(full, prev[i]); !aiter.Done();
+           aiter.Next())
+        inp->AddArc(prev[i], aiter.Value());
+    }
+    online.AdvanceFrames(t + 1);
+    for (size_t i = 0; i < prev.size(); ++i)
+      KALDI_ASSERT(inp->NumArcs(prev[i]) == 0);
+    const Lattice& partial = online.CollapsedLattice();
+    KALDI_ASSERT(partial.NumStates() <= expected.NumStates());
+    KALDI_ASSERT(partial.Start() == expected.Start());
+    bool has_final = false;
+    for (StateId s = 0; s < partial.NumStates(); ++s) {
+      if (partial.NumArcs(s) == 0 && expected.NumArcs(s) > 0) {
+        KALDI_ASSERT(partial.Final(s) == LatticeWeight::One());
+      } else {
+        KALDI_ASSERT(StatesEqual(partial, s, expected, s));
+      }
+      has_final = has_final || partial.Final(s) != LatticeWeight::Zero();
+    }
+    KALDI_ASSERT(has_final);
+  }
+  const std::vector<StateId>& last = frame_states[num_frames];
+  for (size_t i = 0; i < last.size(); ++i)
+    inp->SetFinal(last[i], full.Final(last[i]));
+  online.Finish();
+  KALDI_ASSERT(LatticesEqual(online.CollapsedLattice(), expected));
+}
+
+}  // namespace kaldi
+
+int main() {
+  using namespace kaldi;
+  for (int i = 0; i < 100; ++i) {
+    UnitTestCollapseMatchesComposition();
+    UnitTestCtcTopologies();
+    UnitTestCtcLabelBitsets();
+    UnitTestCtcLabelCompaction();
+    UnitTestParallelCtcBlankCollapser();
+    UnitTestCollapseGridLattice();
+    UnitTestOnlineCtcBlankCollapser();
+  }
+  std::cout << "Test OK.\n";
+  return 0;
+}
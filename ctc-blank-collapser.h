@@ -0,0 +1,858 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CTC_BLANK_COLLAPSER_H_
+#define CTC_BLANK_COLLAPSER_H_
+
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "lat/kaldi-lattice.h"
+#include "lat/lattice-functions.h"
+#include "soa-lattice.h"
+
+namespace kaldi {
+
+// Order of the arcs leaving each output state of the collapsers.
+enum CtcArcSort {
+  kCtcArcSortNone,    // Same order as the input arcs.
+  kCtcArcSortILabel,  // Sorted by input label (as fst::ILabelCompare).
+  kCtcArcSortOLabel   // Sorted by output label (as fst::OLabelCompare).
+};
+
+// Sort the arcs of an output state as given (the sort is stable, and the
+// arcs are usually sorted already when sorting by input label).
+inline void SortCtcArcs(CtcArcSort sort,
+                        std::vector<LatticeArc>::iterator begin,
+                        std::vector<LatticeArc>::iterator end) {
+  if (sort == kCtcArcSortILabel) {
+    fst::ILabelCompare<LatticeArc> comp;
+    if (!std::is_sorted(begin, end, comp)) std::stable_sort(begin, end, comp);
+  } else if (sort == kCtcArcSortOLabel) {
+    fst::OLabelCompare<LatticeArc> comp;
+    if (!std::is_sorted(begin, end, comp)) std::stable_sort(begin, end, comp);
+  }
+}
+
+// FST properties guaranteed by the collapsers, given the order of the arcs.
+inline uint64 CtcCollapsedProperties(CtcArcSort sort) {
+  uint64 props = fst::kTopSorted;
+  if (sort == kCtcArcSortILabel) props |= fst::kILabelSorted;
+  if (sort == kCtcArcSortOLabel) props |= fst::kOLabelSorted;
+  return props;
+}
+
+// Set the properties guaranteed by the collapsers, so that other tools do not
+// need to sort the lattice again.
+inline void SetCtcCollapsedProperties(CtcArcSort sort, Lattice* out) {
+  const uint64 props = CtcCollapsedProperties(sort);
+  uint64 mask = fst::kTopSorted | fst::kNotTopSorted;
+  if (sort == kCtcArcSortILabel)
+    mask |= fst::kILabelSorted | fst::kNotILabelSorted;
+  if (sort == kCtcArcSortOLabel)
+    mask |= fst::kOLabelSorted | fst::kNotOLabelSorted;
+  out->SetProperties(props, mask);
+}
+
+// Sort a lattice that was modified after the collapse (e.g. determinized), so
+// that it has again the properties guaranteed by the collapsers.
+inline void SortCtcLattice(CtcArcSort sort, Lattice* lat) {
+  const uint64 props = CtcCollapsedProperties(sort);
+  if (lat->Properties(props, true) == props) return;
+  if (!fst::TopSort(lat)) KALDI_ERR << "Cannot sort a cyclic lattice";
+  if (sort == kCtcArcSortILabel)
+    fst::ArcSort(lat, fst::ILabelCompare<LatticeArc>());
+  if (sort == kCtcArcSortOLabel)
+    fst::ArcSort(lat, fst::OLabelCompare<LatticeArc>());
+}
+
+// Labels treated as the CTC blank: the blank itself and any other ignorable
+// symbols (e.g. noise or filler tokens), which are all removed from the output
+// and separate repeated symbols in the same way. Usually there are only a
+// few of them, so they are kept in a small vector.
+class CtcBlankSet {
+ public:
+  typedef LatticeArc::Label Label;
+
+  // Implicit, so that a single blank can be given where a set is expected.
+  CtcBlankSet(Label blank) : labels_(1, blank) {}
+
+  explicit CtcBlankSet(const std::vector<Label>& labels) : labels_(labels) {
+    std::sort(labels_.begin(), labels_.end());
+    labels_.erase(std::unique(labels_.begin(), labels_.end()), labels_.end());
+    KALDI_ASSERT(!labels_.empty() && "No blank symbol given");
+  }
+
+  bool IsBlank(Label label) const {
+    for (size_t i = 0; i < labels_.size(); ++i)
+      if (labels_[i] == label) return true;
+    return false;
+  }
+
+  const std::vector<Label>& Labels() const { return labels_; }
+
+ private:
+  std::vector<Label> labels_;
+};
+
+// Topologies of the transducer C, i.e. the rules that turn the frame-level
+// symbols of a path into its output symbols.
+enum CtcTopologyType {
+  // Repeated symbols are collapsed, unless separated by a blank.
+  kCtcTopologyCtc,
+  // Every non-blank symbol is emitted (e.g. RNN-T style alignments, where
+  // the blanks advance the frames and the symbols are emitted once).
+  kCtcTopologyNoRepeat,
+  // Repeated symbols are collapsed even across blanks, so the blanks are just
+  // optional fillers.
+  kCtcTopologyBlankOptional,
+  // HMM-like 2-state topology: each symbol l has a begin label l, emitted
+  // once, and a loop label l + offset for the following frames, which can
+  // only follow the begin or loop labels of the same symbol.
+  kCtcTopologyHmm2
+};
+
+// Role of the output label of an input arc in the collapse, given by
+// CtcTopology::Classify() along with the state of C of its symbol (key).
+enum CtcArcKind {
+  kCtcArcEpsilon,  // Keeps the state of C and emits nothing.
+  kCtcArcBlank,    // Goes to state 0 of C and emits nothing.
+  kCtcArcSymbol,   // Goes to state key, emits its label unless already there.
+  kCtcArcBegin,    // Goes to state key and always emits its label.
+  kCtcArcLoop      // Only from state key, which it keeps, and emits nothing.
+};
+
+class CtcTopology {
+ public:
+  typedef LatticeArc::Label Label;
+
+  explicit CtcTopology(CtcTopologyType type = kCtcTopologyCtc,
+                       Label loop_offset = 0)
+      : type_(type), loop_offset_(loop_offset) {
+    KALDI_ASSERT((type != kCtcTopologyHmm2 || loop_offset > 0) &&
+                 "The HMM-like topology needs the offset of the loop labels");
+  }
+
+  CtcTopologyType Type() const { return type_; }
+  Label LoopOffset() const { return loop_offset_; }
+
+  // Whether some input arcs are not allowed from some states of C, so the
+  // output may have states that do not reach a final state.
+  bool MayDropArcs() const { return type_ == kCtcTopologyHmm2; }
+
+  CtcArcKind Classify(Label olabel, const CtcBlankSet& blanks,
+                      Label* key) const {
+    *key = 0;
+    if (olabel == 0) return kCtcArcEpsilon;
+    if (blanks.IsBlank(olabel)) {
+      return type_ == kCtcTopologyBlankOptional ? kCtcArcEpsilon :
+          kCtcArcBlank;
+    }
+    switch (type_) {
+      case kCtcTopologyNoRepeat:
+        return kCtcArcBegin;
+      case kCtcTopologyHmm2:
+        if (olabel > loop_offset_) {
+          *key = olabel - loop_offset_;
+          return kCtcArcLoop;
+        }
+        *key = olabel;
+        return kCtcArcBegin;
+      default:
+        *key = olabel;
+        return kCtcArcSymbol;
+    }
+  }
+
+ private:
+  CtcTopologyType type_;
+  Label loop_offset_;
+};
+
+// Set of states of C (labels, 0 for blank) paired with an input state, for
+// any label. See CtcLabelBitset for small vocabularies.
+class CtcLabelVector {
+ public:
+  typedef LatticeArc::Label Label;
+
+  void Clear() { labels_.clear(); }
+  void Insert(Label q) { labels_.push_back(q); }
+  void Union(const CtcLabelVector& other) {
+    labels_.insert(labels_.end(), other.labels_.begin(), other.labels_.end());
+  }
+  // Must be called after the insertions, before the queries below.
+  void Finalize() {
+    std::sort(labels_.begin(), labels_.end());
+    labels_.erase(std::unique(labels_.begin(), labels_.end()), labels_.end());
+  }
+  void Swap(CtcLabelVector* other) { labels_.swap(other->labels_); }
+
+  size_t Size() const { return labels_.size(); }
+  bool Contains(Label q) const {
+    return std::binary_search(labels_.begin(), labels_.end(), q);
+  }
+  // Position of q among the labels in the set (which must contain q).
+  size_t Rank(Label q) const {
+    return std::lower_bound(labels_.begin(), labels_.end(), q) -
+        labels_.begin();
+  }
+  // Call f(k, q) for the k-th label q in the set, in increasing order.
+  template <class F>
+  void ForEach(const F& f) const {
+    for (size_t k = 0; k < labels_.size(); ++k) f(k, labels_[k]);
+  }
+
+ private:
+  std::vector<Label> labels_;
+};
+
+// Set of labels lower than MaxLabels, as a fixed-size bitset: no dynamic
+// allocation, and the position of each label is a population count.
+template <int32 MaxLabels>
+class CtcLabelBitset {
+ public:
+  typedef LatticeArc::Label Label;
+
+  CtcLabelBitset() { Clear(); }
+
+  static bool Supports(Label label) {
+    return label >= 0 && label < MaxLabels;
+  }
+
+  void Clear() {
+    std::fill(words_, words_ + kNumWords, 0);
+    size_ = 0;
+  }
+  void Insert(Label q) { words_[q >> 6] |= (uint64(1) << (q & 63)); }
+  void Union(const CtcLabelBitset& other) {
+    for (int32 w = 0; w < kNumWords; ++w) words_[w] |= other.words_[w];
+  }
+  void Finalize() {
+    size_ = 0;
+    for (int32 w = 0; w < kNumWords; ++w)
+      size_ += __builtin_popcountll(words_[w]);
+  }
+  void Swap(CtcLabelBitset* other) { std::swap(*this, *other); }
+
+  size_t Size() const { return size_; }
+  bool Contains(Label q) const {
+    return (words_[q >> 6] >> (q & 63)) & 1;
+  }
+  size_t Rank(Label q) const {
+    size_t rank = 0;
+    const int32 w = q >> 6;
+    for (int32 i = 0; i < w; ++i) rank += __builtin_popcountll(words_[i]);
+    const uint64 below = (uint64(1) << (q & 63)) - 1;
+    return rank + __builtin_popcountll(words_[w] & below);
+  }
+  template <class F>
+  void ForEach(const F& f) const {
+    size_t k = 0;
+    for (int32 w = 0; w < kNumWords; ++w) {
+      for (uint64 bits = words_[w]; bits != 0; bits &= bits - 1)
+        f(k++, static_cast<Label>(w * 64 + __builtin_ctzll(bits)));
+    }
+  }
+
+ private:
+  static const int32 kNumWords = (MaxLabels + 63) / 64;
+  uint64 words_[kNumWords];
+  size_t size_;
+};
+
+// Dense numbering of the states of C of the symbols present in a lattice, so
+// that those of lattices with sparse label ids (e.g. a few symbols of a large
+// shared symbol table) fit in small bitsets. The states given by
+// CtcTopology::Classify() are numbered 1, ..., K in increasing order (so the
+// output states, sorted by state of C, are the same), and state 0 (blank) is
+// kept. The collapsers use the kinds and keys of the arcs computed here to
+// number their output states, and still emit the original labels.
+class CtcLabelCompaction {
+ public:
+  typedef LatticeArc::Label Label;
+
+  // Classify and number the labels of inp. Returns false if it has more than
+  // max_keys distinct states of C (the keys are not computed then).
+  bool Init(const SoaLattice& inp, const CtcBlankSet& blanks,
+            const CtcTopology& topology, Label max_keys) {
+    const std::vector<Label>& olabels = inp.OLabels();
+    kinds_.resize(olabels.size());
+    keys_.resize(olabels.size());
+    index_.clear();
+    for (size_t a = 0; a < olabels.size(); ++a) {
+      Label key;
+      kinds_[a] = topology.Classify(olabels[a], blanks, &key);
+      keys_[a] = key;
+      if (key == 0 || !index_.insert(std::make_pair(key, 0)).second)
+        continue;
+      if (index_.size() > static_cast<size_t>(max_keys)) return false;
+    }
+    labels_.clear();
+    for (const auto& p : index_) labels_.push_back(p.first);
+    std::sort(labels_.begin(), labels_.end());
+    for (size_t k = 0; k < labels_.size(); ++k) index_[labels_[k]] = k + 1;
+    for (size_t a = 0; a < keys_.size(); ++a)
+      if (keys_[a] != 0) keys_[a] = index_[keys_[a]];
+    return true;
+  }
+
+  // Number of distinct states of C, besides 0 (i.e. the largest key).
+  Label NumLabels() const { return labels_.size(); }
+  // Kind and key of the output label of arc a of the lattice.
+  CtcArcKind Classify(size_t a, Label* key) const {
+    *key = keys_[a];
+    return static_cast<CtcArcKind>(kinds_[a]);
+  }
+
+ private:
+  std::unordered_map<Label, Label> index_;
+  std::vector<Label> labels_;
+  std::vector<char> kinds_;
+  std::vector<Label> keys_;
+};
+
+// Computes compose(inp, C), where C is the CTC transducer described in the
+// README, without building C or running a generic composition.
+//
+// Each state of the output is a pair (s, q) of an input state s and the state
+// q of C reached after the incoming arc of s, represented by the last symbol
+// read (0 after a blank and at the start). The arc of the input with label l
+// leaving s produces, for each pair (s, q):
+//  - l = blank:   an arc to (n, 0) with output label 0.
+//  - l = 0:       an arc to (n, q) with output label 0 (input epsilons).
+//  - l = q:       an arc to (n, q) with output label 0 (repeated symbol).
+//  - otherwise:   an arc to (n, l) with output label l.
+// So, the states q paired with s are simply the labels of the arcs entering
+// s (or their q's, for epsilon arcs). All the labels of the CtcBlankSet are
+// blanks. These are the rules of the standard CTC topology; other topologies
+// (see CtcTopology) change the role of some labels (see CtcArcKind), e.g. the
+// loop labels of the HMM-like topology only leave the pairs with their own
+// symbol, so the output may have dead states.
+//
+// The input states must be topologically sorted (all arcs go to higher state
+// ids). They are processed in order: when all the states before s have been
+// read, all the pairs (s, q) are known and they get consecutive output state
+// ids (sorted by q), so the output is topologically sorted too. The arcs
+// leaving the pairs of s are added once all the target states of s are
+// numbered, following the order of the input arcs (or sorted, see
+// CtcArcSort), so only the states of C of the input states spanned by the
+// arcs of the last ones read are kept. Besides the input and output lattices,
+// the working memory depends on the span of the arcs, not on the length of
+// the lattice. The input can also be given incrementally (see Advance()).
+// The input is read from a SoaLattice, since only the output labels and next
+// states of the arcs are needed to number the output states.
+//
+// LabelSet is the representation of the states of C paired with each input
+// state: CtcLabelVector for any label, or CtcLabelBitset for small
+// vocabularies (see DispatchingCtcBlankCollapser).
+template <class LabelSet>
+class CtcBlankCollapserTpl {
+ public:
+  typedef LatticeArc::StateId StateId;
+  typedef LatticeArc::Label Label;
+
+  explicit CtcBlankCollapserTpl(const CtcBlankSet& blanks,
+                                CtcArcSort sort = kCtcArcSortNone,
+                                const CtcTopology& topology = CtcTopology())
+      : blanks_(blanks), sort_(sort), topology_(topology), inp_(NULL),
+        compaction_(NULL), out_(NULL), partial_(false), opened_end_(0),
+        emitted_end_(0) {}
+
+  CtcArcSort ArcSort() const { return sort_; }
+  const CtcTopology& Topology() const { return topology_; }
+
+  // Start collapsing the given input lattice into out (which is cleared).
+  // The buffers of the previous lattice are reused. If compaction is not
+  // NULL, the arcs are classified and the states of C numbered by it (see
+  // CtcLabelCompaction), with the same topology.
+  // If partial is true, out holds the partial hypotheses while the input is
+  // processed: the output states whose arcs are not added yet are final with
+  // weight One, and get their own final weight when their arcs are added.
+  void Init(const SoaLattice* inp, Lattice* out,
+            const CtcLabelCompaction* compaction = NULL,
+            bool partial = false) {
+    inp_ = inp;
+    compaction_ = compaction;
+    out_ = out;
+    partial_ = partial;
+    out_->DeleteStates();
+    pending_.clear();
+    window_.clear();
+    opened_end_ = emitted_end_ = 0;
+  }
+
+  // Process the input states with ids lower than end. Their arcs (and final
+  // weights) must be complete, but more states can be added to the input
+  // lattice later.
+  void Advance(StateId end) {
+    end = std::min(end, inp_->NumStates());
+    while (opened_end_ < end) {
+      Open(opened_end_);
+      // Add the arcs of the states whose targets are all open.
+      while (!window_.empty() && window_.front().max_target < opened_end_) {
+        AddArcs(emitted_end_, window_.front());
+        window_.pop_front();
+        ++emitted_end_;
+      }
+    }
+  }
+
+  // Process all the remaining input states.
+  void Finish() { Advance(inp_->NumStates()); }
+
+  // Number of input states processed so far.
+  StateId NumInputStatesDone() const { return opened_end_; }
+
+ private:
+  struct InputState {
+    // Output state of the first pair (s, q).
+    StateId base;
+    // Largest target state of the arcs leaving s.
+    StateId max_target;
+    // States of C paired with s.
+    LabelSet cstates;
+  };
+
+  // Number the output states paired with input state s, and propagate its
+  // states of C to the states it is connected to.
+  void Open(StateId s) {
+    window_.push_back(InputState());
+    InputState& st = window_.back();
+    st.base = out_->NumStates();
+    st.max_target = -1;
+    // pending_ starts at state s.
+    if (!pending_.empty()) {
+      st.cstates.Swap(&pending_.front());
+      pending_.pop_front();
+    }
+    if (s == inp_->Start()) st.cstates.Insert(0);
+    st.cstates.Finalize();
+    ++opened_end_;
+    // Inaccessible states of the input do not produce any output state.
+    if (st.cstates.Size() == 0) return;
+    const LatticeWeight final_weight =
+        partial_ ? LatticeWeight::One() : inp_->Final(s);
+    const size_t num_arcs = inp_->NumArcs(s);
+    for (size_t k = 0; k < st.cstates.Size(); ++k) {
+      const StateId o = out_->AddState();
+      out_->SetFinal(o, final_weight);
+      out_->ReserveArcs(o, num_arcs);
+    }
+    if (s == inp_->Start()) out_->SetStart(st.base);
+    for (size_t a = inp_->ArcBegin(s); a < inp_->ArcEnd(s); ++a) {
+      const StateId n = inp_->NextState(a);
+      KALDI_ASSERT(n > s && "Input lattice is not topologically sorted");
+      st.max_target = std::max(st.max_target, n);
+      // Now pending_ starts at state s + 1.
+      const size_t i = n - s - 1;
+      while (pending_.size() <= i) pending_.push_back(LabelSet());
+      Label key;
+      switch (Classify(a, &key)) {
+        case kCtcArcEpsilon:
+          pending_[i].Union(st.cstates);
+          break;
+        case kCtcArcLoop:
+          if (st.cstates.Contains(key)) pending_[i].Insert(key);
+          break;
+        default:
+          pending_[i].Insert(key);
+      }
+    }
+  }
+
+  // Kind of arc a and the state of C of its symbol (see CtcTopology).
+  CtcArcKind Classify(size_t a, Label* key) const {
+    if (compaction_ != NULL) return compaction_->Classify(a, key);
+    return topology_.Classify(inp_->OLabel(a), blanks_, key);
+  }
+
+  // Output state of the pair (n, q). Input state n must be open.
+  StateId OutputState(StateId n, Label q) const {
+    const InputState& st = window_[n - emitted_end_];
+    return st.base + st.cstates.Rank(q);
+  }
+
+  // Add the arcs leaving all the output states paired with input state s,
+  // whose target states must be open.
+  void AddArcs(StateId s, const InputState& st) {
+    if (st.cstates.Size() == 0) return;
+    // Kinds and keys of the arcs, and their targets when they do not depend
+    // on q (i.e. for all the kinds but epsilons and loops).
+    const size_t begin = inp_->ArcBegin(s), end = inp_->ArcEnd(s);
+    kinds_.clear();
+    keys_.clear();
+    targets_.clear();
+    for (size_t a = begin; a < end; ++a) {
+      const StateId n = inp_->NextState(a);
+      Label key;
+      const CtcArcKind kind = Classify(a, &key);
+      kinds_.push_back(kind);
+      keys_.push_back(key);
+      if (kind == kCtcArcEpsilon || kind == kCtcArcLoop) {
+        targets_.push_back(fst::kNoStateId);
+      } else {
+        targets_.push_back(OutputState(n, key));
+      }
+    }
+    st.cstates.ForEach([&](size_t k, Label q) {
+        const StateId o = st.base + k;
+        arcs_.clear();
+        for (size_t a = begin; a < end; ++a) {
+          const StateId n = inp_->NextState(a);
+          const Label key = keys_[a - begin];
+          Label olabel = 0;
+          StateId target = targets_[a - begin];
+          switch (kinds_[a - begin]) {
+            case kCtcArcLoop:
+              if (key != q) continue;
+              // Fall through.
+            case kCtcArcEpsilon:
+              target = OutputState(n, q);
+              break;
+            case kCtcArcSymbol:
+              if (key != q) olabel = inp_->OLabel(a);
+              break;
+            case kCtcArcBegin:
+              olabel = inp_->OLabel(a);
+              break;
+            default:
+              break;
+          }
+          arcs_.push_back(LatticeArc(inp_->ILabel(a), olabel, inp_->Weight(a),
+                                     target));
+        }
+        SortCtcArcs(sort_, arcs_.begin(), arcs_.end());
+        for (size_t i = 0; i < arcs_.size(); ++i) out_->AddArc(o, arcs_[i]);
+        if (partial_) out_->SetFinal(o, inp_->Final(s));
+      });
+  }
+
+  const CtcBlankSet blanks_;
+  const CtcArcSort sort_;
+  const CtcTopology topology_;
+  const SoaLattice* inp_;
+  // Kinds and keys of the input arcs, or NULL to classify their labels.
+  const CtcLabelCompaction* compaction_;
+  Lattice* out_;
+  // Whether out_ holds the partial hypotheses (see Init()).
+  bool partial_;
+  // States of C reaching the input states not opened yet, starting at
+  // opened_end_.
+  std::deque<LabelSet> pending_;
+  // Input states in [emitted_end_, opened_end_).
+  std::deque<InputState> window_;
+  // All the input states lower than this have been opened.
+  StateId opened_end_;
+  // All the input states lower than this have their arcs in the output.
+  StateId emitted_end_;
+  // Buffers for the kinds, keys and targets of the arcs of the state being
+  // emitted.
+  std::vector<CtcArcKind> kinds_;
+  std::vector<Label> keys_;
+  std::vector<StateId> targets_;
+  // Buffer for the arcs of the output state being emitted.
+  std::vector<LatticeArc> arcs_;
+};
+
+typedef CtcBlankCollapserTpl<CtcLabelVector> CtcBlankCollapser;
+
+// Collapser that chooses, for each lattice, the fastest representation of
+// the states of C given the largest label in the lattice: fixed-size bitsets
+// for vocabularies of up to 128, 256 or 1024 labels, or sorted vectors
+// otherwise. Lattices with larger labels, but with few distinct ones, have
+// their labels compacted first (see CtcLabelCompaction), so they can still use
+// the bitsets.
+class DispatchingCtcBlankCollapser {
+ public:
+  typedef LatticeArc::Label Label;
+
+  explicit DispatchingCtcBlankCollapser(
+      const CtcBlankSet& blanks, CtcArcSort sort = kCtcArcSortNone,
+      const CtcTopology& topology = CtcTopology())
+      : collapser128_(blanks, sort, topology),
+        collapser256_(blanks, sort, topology),
+        collapser1024_(blanks, sort, topology),
+        collapser_(blanks, sort, topology), blanks_(blanks), sort_(sort),
+        topology_(topology) {}
+
+  CtcArcSort ArcSort() const { return sort_; }
+  const CtcTopology& Topology() const { return topology_; }
+
+  // Collapse the topologically sorted lattice inp into out.
+  void Collapse(const SoaLattice& inp, Lattice* out) {
+    // Largest state of C (the blanks are mapped to state 0).
+    Label max_label = 0;
+    const std::vector<Label>& olabels = inp.OLabels();
+    for (size_t a = 0; a < olabels.size(); ++a) {
+      Label key;
+      topology_.Classify(olabels[a], blanks_, &key);
+      max_label = std::max(max_label, key);
+    }
+    if (CtcLabelBitset<128>::Supports(max_label)) {
+      Collapse(inp, NULL, &collapser128_, out);
+    } else if (CtcLabelBitset<256>::Supports(max_label)) {
+      Collapse(inp, NULL, &collapser256_, out);
+    } else if (CtcLabelBitset<1024>::Supports(max_label)) {
+      Collapse(inp, NULL, &collapser1024_, out);
+    } else if (compaction_.Init(inp, blanks_, topology_, 1023)) {
+      const Label num_labels = compaction_.NumLabels();
+      if (CtcLabelBitset<128>::Supports(num_labels)) {
+        Collapse(inp, &compaction_, &collapser128_, out);
+      } else if (CtcLabelBitset<256>::Supports(num_labels)) {
+        Collapse(inp, &compaction_, &collapser256_, out);
+      } else {
+        Collapse(inp, &compaction_, &collapser1024_, out);
+      }
+    } else {
+      Collapse(inp, NULL, &collapser_, out);
+    }
+  }
+
+ private:
+  template <class Collapser>
+  static void Collapse(const SoaLattice& inp,
+                       const CtcLabelCompaction* compaction,
+                       Collapser* collapser, Lattice* out) {
+    collapser->Init(&inp, out, compaction);
+    collapser->Finish();
+  }
+
+  CtcBlankCollapserTpl<CtcLabelBitset<128> > collapser128_;
+  CtcBlankCollapserTpl<CtcLabelBitset<256> > collapser256_;
+  CtcBlankCollapserTpl<CtcLabelBitset<1024> > collapser1024_;
+  CtcBlankCollapser collapser_;
+  CtcLabelCompaction compaction_;
+  const CtcBlankSet blanks_;
+  const CtcArcSort sort_;
+  const CtcTopology topology_;
+};
+
+// Fold the epsilon output arcs (blanks and repeated symbols) of a collapsed
+// lattice into the arcs with characters, and remove the dead states, in a
+// single pass. The result is an epsilon-free acceptor of the characters
+// (the alignments are lost), equivalent to projecting the collapsed lattice
+// on its output labels and running fst::RmEpsilon() and fst::Connect().
+//
+// The epsilon closures are computed backwards: each state gets the
+// character arcs and final weight reachable through its epsilon arcs, with
+// the best weight for each (label, target) pair. Only the start state and
+// the targets of character arcs reachable from it become output states.
+// Note that each state gets arcs to all the characters reachable through a
+// run of blanks, so the output may have more arcs than the input if the
+// lattice is not pruned.
+inline void FoldCtcBlanks(const Lattice& collapsed, Lattice* folded) {
+  typedef LatticeArc::StateId StateId;
+  folded->DeleteStates();
+  if (collapsed.Start() == fst::kNoStateId) return;
+  if (collapsed.Properties(fst::kTopSorted, true) != fst::kTopSorted) {
+    Lattice sorted(collapsed);
+    if (!fst::TopSort(&sorted)) KALDI_ERR << "Input lattice is cyclic";
+    FoldCtcBlanks(sorted, folded);
+    return;
+  }
+  const StateId num_states = collapsed.NumStates();
+  // Character arcs reachable from each state through epsilon arcs (target
+  // states are still those of the collapsed lattice).
+  std::vector<std::vector<LatticeArc> > closure(num_states);
+  std::vector<LatticeWeight> final_weight(num_states, LatticeWeight::Zero());
+  std::unordered_map<uint64, size_t> index;
+  for (StateId s = num_states - 1; s >= 0; --s) {
+    std::vector<LatticeArc>& arcs = closure[s];
+    LatticeWeight f = collapsed.Final(s);
+    index.clear();
+    // Add an arc to the closure of s, or combine it with the arc with the
+    // same label and target.
+    auto add_arc = [&arcs, &index](const LatticeArc& arc) {
+      const uint64 key = (static_cast<uint64>(arc.olabel) << 32) |
+          static_cast<uint32>(arc.nextstate);
+      std::pair<std::unordered_map<uint64, size_t>::iterator, bool> r =
+          index.insert(std::make_pair(key, arcs.size()));
+      if (r.second) {
+        arcs.push_back(arc);
+      } else {
+        LatticeArc& prev = arcs[r.first->second];
+        prev.weight = fst::Plus(prev.weight, arc.weight);
+      }
+    };
+    for (fst::ArcIterator<Lattice> aiter(collapsed, s); !aiter.Done();
+         aiter.Next()) {
+      const LatticeArc& arc = aiter.Value();
+      const StateId n = arc.nextstate;
+      KALDI_ASSERT(n > s && "Input lattice is not topologically sorted");
+      if (arc.olabel != 0) {
+        // Only arcs to live states (which reach a final state).
+        if (closure[n].empty() && final_weight[n] == LatticeWeight::Zero())
+          continue;
+        add_arc(LatticeArc(arc.olabel, arc.olabel, arc.weight, n));
+        continue;
+      }
+      f = fst::Plus(f, fst::Times(arc.weight, final_weight[n]));
+      for (size_t k = 0; k < closure[n].size(); ++k) {
+        LatticeArc folded_arc = closure[n][k];
+        folded_arc.weight = fst::Times(arc.weight, folded_arc.weight);
+        add_arc(folded_arc);
+      }
+    }
+    final_weight[s] = f;
+  }
+  // Number the states reachable through character arcs, in order.
+  std::vector<StateId> state_map(num_states, fst::kNoStateId);
+  const StateId start = collapsed.Start();
+  if (closure[start].empty() && final_weight[start] == LatticeWeight::Zero())
+    return;
+  state_map[start] = 0;
+  for (StateId s = start; s < num_states; ++s) {
+    if (state_map[s] == fst::kNoStateId) continue;
+    for (size_t k = 0; k < closure[s].size(); ++k)
+      state_map[closure[s][k].nextstate] = 0;
+  }
+  StateId num_folded = 0;
+  for (StateId s = 0; s < num_states; ++s)
+    if (state_map[s] != fst::kNoStateId) state_map[s] = num_folded++;
+  folded->ReserveStates(num_folded);
+  for (StateId s = 0; s < num_states; ++s) {
+    if (state_map[s] == fst::kNoStateId) continue;
+    const StateId o = folded->AddState();
+    folded->SetFinal(o, final_weight[s]);
+    folded->ReserveArcs(o, closure[s].size());
+    for (size_t k = 0; k < closure[s].size(); ++k) {
+      LatticeArc arc = closure[s][k];
+      arc.nextstate = state_map[arc.nextstate];
+      folded->AddArc(o, arc);
+    }
+  }
+  folded->SetStart(state_map[start]);
+}
+
+// Incremental version of CtcBlankCollapser for streaming decoders. The
+// decoder extends the input lattice (see InputLattice()) frame by frame and
+// calls AdvanceFrames() to collapse the new frames, so each update costs time
+// proportional to the number of new states, not to the length of the
+// utterance.
+//
+// The collapsed lattice holds the partial hypotheses at any time (see
+// CollapsedLattice()), so they are also available without any copy.
+//
+// Usage:
+//   OnlineCtcBlankCollapser collapser(blank);
+//   Lattice* inp = collapser.InputLattice();
+//   // For each decoded frame t: add the states and arcs of the frame to
+//   // inp, then call collapser.AdvanceFrames(t + 1), and optionally read
+//   // the partial hypotheses from collapser.CollapsedLattice().
+//   // At the end: set the final weights and call collapser.Finish().
+//   const Lattice& result = collapser.CollapsedLattice();
+class OnlineCtcBlankCollapser {
+ public:
+  typedef LatticeArc::StateId StateId;
+  typedef LatticeArc::Label Label;
+
+  explicit OnlineCtcBlankCollapser(
+      const CtcBlankSet& blanks, const CtcTopology& topology = CtcTopology())
+      : collapser_(blanks, kCtcArcSortNone, topology), next_state_(0) {
+    Reset();
+  }
+
+  // Start a new utterance: the input and collapsed lattices are cleared.
+  void Reset() {
+    inp_.DeleteStates();
+    soa_inp_.Clear();
+    state_times_.clear();
+    next_state_ = 0;
+    collapser_.Init(&soa_inp_, &out_, NULL, true);
+  }
+
+  // Input lattice, extended by the decoder. The states must be added in
+  // topological order (all arcs go to higher state ids), and the start
+  // state must be set before the first call to AdvanceFrames(). The arcs of
+  // the states processed are moved out of it (see AdvanceFrames()).
+  Lattice* InputLattice() { return &inp_; }
+
+  // Collapse all the input states at times lower than num_frames. The arcs
+  // and final weights of these states must be complete: the final weights
+  // are usually set at the end, on the states of the last frame, which are
+  // only processed by Finish(). The arcs of these states are then kept only
+  // by the collapser, and deleted from the input lattice.
+  void AdvanceFrames(int32 num_frames) {
+    const StateId num_states = inp_.NumStates();
+    state_times_.resize(num_states, -1);
+    for (; next_state_ < num_states; ++next_state_) {
+      const StateId s = next_state_;
+      if (s == inp_.Start()) state_times_[s] = 0;
+      // States not reached from the start yet can not be completed.
+      if (state_times_[s] < 0 || state_times_[s] >= num_frames) break;
+      for (fst::ArcIterator<Lattice> aiter(inp_, s); !aiter.Done();
+           aiter.Next()) {
+        const LatticeArc& arc = aiter.Value();
+        KALDI_ASSERT(arc.nextstate > s &&
+                     "Input lattice is not topologically sorted");
+        state_times_[arc.nextstate] =
+            state_times_[s] + (arc.ilabel != 0 ? 1 : 0);
+      }
+    }
+    MoveInputStates();
+    collapser_.Advance(next_state_);
+  }
+
+  // Collapse the remaining input states (e.g. those of the last frame).
+  void Finish() {
+    next_state_ = inp_.NumStates();
+    MoveInputStates();
+    collapser_.Finish();
+  }
+
+  // Lattice collapsed so far, which is complete only after Finish(). Before,
+  // its last states do not have their arcs yet and are final with weight
+  // One, so it contains the partial hypotheses: the collapsed paths that
+  // reach the last processed frames. It may have states that do not reach
+  // any final state (paths that the decoder did not extend).
+  const Lattice& CollapsedLattice() const { return out_; }
+
+ private:
+  // Move the input states before next_state_ to soa_inp_.
+  void MoveInputStates() {
+    const StateId begin = soa_inp_.NumStates();
+    soa_inp_.Append(inp_, next_state_);
+    for (StateId s = begin; s < next_state_; ++s) inp_.DeleteArcs(s);
+  }
+
+  // States of the input not processed yet (the processed ones have no arcs).
+  Lattice inp_;
+  // Processed states of the input, read by the collapser.
+  SoaLattice soa_inp_;
+  Lattice out_;
+  CtcBlankCollapser collapser_;
+  // Times of the input states, known once all their predecessors have been
+  // processed.
+  std::vector<int32> state_times_;
+  // Next input state to process.
+  StateId next_state_;
+
+  OnlineCtcBlankCollapser(const OnlineCtcBlankCollapser&);
+  OnlineCtcBlankCollapser& operator=(const OnlineCtcBlankCollapser&);
+};
+
+}  // namespace kaldi
+
+#endif  // CTC_BLANK_COLLAPSER_H_
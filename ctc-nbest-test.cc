@@ -0,0 +1,281 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <map>
+
+#include "base/kaldi-common.h"
+#include "base/kaldi-math.h"
+#include "lat/kaldi-lattice.h"
+#include "ctc-blank-collapser.h"
+#include "ctc-nbest.h"
+
+namespace kaldi {
+
+typedef LatticeArc::StateId StateId;
+
+static const CtcArcSort kSortTypes[] = {
+  kCtcArcSortNone, kCtcArcSortILabel, kCtcArcSortOLabel
+};
+
+static LatticeWeight RandomWeight() {
+  return LatticeWeight(RandInt(0, 10) * 0.5, RandInt(0, 10) * 0.25);
+}
+
+// Lattice with the transcriptions "1 3" and "2 1 3", aligned with some
+// frames of CTC blanks (label 4). After dropping the alignments, the state
+// reached by "2" is discovered after the one reached by "1", but it has an
+// arc to it ("2 1" reaches the same state as "1" once minimized), so the
+// determinized lattice is not topologically sorted.
+static void BuildCrossingLattice(Lattice* lat) {
+  lat->DeleteStates();
+  for (int s = 0; s < 8; ++s) lat->AddState();
+  lat->SetStart(0);
+  lat->AddArc(0, LatticeArc(1, 1, LatticeWeight(1.0, 1.0), 1));
+  lat->AddArc(1, LatticeArc(4, 0, LatticeWeight(0.0, 0.5), 2));
+  lat->AddArc(0, LatticeArc(2, 2, LatticeWeight(0.5, 1.0), 3));
+  lat->AddArc(3, LatticeArc(1, 1, LatticeWeight(0.5, 0.5), 4));
+  lat->AddArc(2, LatticeArc(3, 3, LatticeWeight(1.0, 0.5), 5));
+  lat->AddArc(4, LatticeArc(4, 0, LatticeWeight(0.0, 0.5), 6));
+  lat->AddArc(6, LatticeArc(3, 3, LatticeWeight(1.0, 0.5), 7));
+  lat->SetFinal(5, LatticeWeight::One());
+  lat->SetFinal(7, LatticeWeight::One());
+}
+
+// Random acyclic lattice whose states are not numbered in topological order:
+// arcs go from state s to a state with a lower number.
+static void BuildRandomLattice(Lattice* lat) {
+  lat->DeleteStates();
+  const int num_states = RandInt(2, 12);
+  for (int s = 0; s < num_states; ++s) lat->AddState();
+  lat->SetStart(num_states - 1);
+  for (StateId s = num_states - 1; s > 0; --s) {
+    lat->AddArc(s, LatticeArc(RandInt(1, 5), RandInt(0, 5), RandomWeight(),
+                              RandInt(0, s - 1)));
+    const int num_arcs = RandInt(0, 3);
+    for (int a = 0; a < num_arcs; ++a) {
+      lat->AddArc(s, LatticeArc(RandInt(1, 5), RandInt(0, 5), RandomWeight(),
+                                RandInt(0, s - 1)));
+    }
+  }
+  lat->SetFinal(0, RandomWeight());
+}
+
+// The n-best transcriptions of both lattices must be the same, with the same
+// costs. Transcriptions with tied costs may come in any order, so each group
+// of ties is compared after sorting it; the last group is skipped when the
+// n-best lists are full, since each list may keep different ties.
+static void AssertSameTranscriptions(const Lattice& a, const Lattice& b) {
+  const int32 n = 100;
+  std::vector<std::vector<int32> > trans_a, trans_b;
+  std::vector<double> costs_a, costs_b;
+  GetNBestTranscriptions(a, n, false, &trans_a, &costs_a);
+  GetNBestTranscriptions(b, n, false, &trans_b, &costs_b);
+  KALDI_ASSERT(trans_a.size() == trans_b.size());
+  for (size_t i = 0; i < costs_a.size(); ++i)
+    KALDI_ASSERT(ApproxEqual(costs_a[i], costs_b[i]));
+  size_t end = trans_a.size();
+  if (end == static_cast<size_t>(n)) {
+    while (end > 0 && ApproxEqual(costs_a[end - 1], costs_a.back())) --end;
+  }
+  for (size_t i = 0; i < end; ) {
+    size_t j = i + 1;
+    while (j < end && ApproxEqual(costs_a[j], costs_a[i])) ++j;
+    std::sort(trans_a.begin() + i, trans_a.begin() + j);
+    std::sort(trans_b.begin() + i, trans_b.begin() + j);
+    i = j;
+  }
+  KALDI_ASSERT(std::equal(trans_a.begin(), trans_a.begin() + end,
+                          trans_b.begin()));
+}
+
+// The lattices must have again the properties of the collapsed lattices after
+// SortCtcLattice(), even when they are not topologically sorted.
+void UnitTestSortCtcLattice() {
+  for (size_t t = 0; t < sizeof(kSortTypes) / sizeof(kSortTypes[0]); ++t) {
+    const uint64 props = CtcCollapsedProperties(kSortTypes[t]);
+    Lattice lat;
+    BuildRandomLattice(&lat);
+    Lattice sorted(lat);
+    SortCtcLattice(kSortTypes[t], &sorted);
+    KALDI_ASSERT(sorted.Properties(props, true) == props);
+    KALDI_ASSERT(sorted.NumStates() == lat.NumStates());
+    AssertSameTranscriptions(lat, sorted);
+  }
+}
+
+// Dropping the alignments determinizes the lattice, which must be sorted
+// again afterwards (as LatticeCtcBlankRemover::Process() does).
+void UnitTestDropAlignmentsSorted() {
+  for (size_t t = 0; t < sizeof(kSortTypes) / sizeof(kSortTypes[0]); ++t) {
+    const uint64 props = CtcCollapsedProperties(kSortTypes[t]);
+    for (int i = 0; i < 2; ++i) {
+      Lattice lat;
+      if (i == 0) {
+        BuildCrossingLattice(&lat);
+      } else {
+        BuildRandomLattice(&lat);
+      }
+      SortCtcLattice(kSortTypes[t], &lat);
+      Lattice dropped(lat);
+      fst::DeterminizeLatticeOptions opts;
+      KALDI_ASSERT(DropAlignments(opts, &dropped));
+      SortCtcLattice(kSortTypes[t], &dropped);
+      KALDI_ASSERT(dropped.Properties(props, true) == props);
+      AssertSameTranscriptions(lat, dropped);
+    }
+  }
+}
+
+// After dropping the alignments, the lattice must be an epsilon-free
+// acceptor of the transcriptions, both when it is determinized and when the
+// determinization fails (max_mem is exceeded) and it is only projected.
+void UnitTestDropAlignmentsLabels() {
+  for (int i = 0; i < 2; ++i) {
+    Lattice lat;
+    if (i == 0) {
+      BuildCrossingLattice(&lat);
+    } else {
+      BuildRandomLattice(&lat);
+    }
+    for (int j = 0; j < 2; ++j) {
+      fst::DeterminizeLatticeOptions opts;
+      if (j == 1) opts.max_mem = 1;
+      Lattice dropped(lat);
+      KALDI_ASSERT(DropAlignments(opts, &dropped) == (j == 0));
+      for (StateId s = 0; s < dropped.NumStates(); ++s) {
+        for (fst::ArcIterator<Lattice> aiter(dropped, s); !aiter.Done();
+             aiter.Next()) {
+          const LatticeArc& arc = aiter.Value();
+          KALDI_ASSERT(arc.ilabel != 0 && arc.ilabel == arc.olabel);
+        }
+      }
+      AssertSameTranscriptions(lat, dropped);
+    }
+  }
+}
+
+// FoldCtcBlanks() must give an epsilon-free acceptor with the same
+// transcriptions and costs as projecting the lattice on its output labels and
+// removing the epsilons and the dead states, also with states that do not
+// reach a final state.
+void UnitTestFoldCtcBlanks() {
+  Lattice lat;
+  BuildRandomLattice(&lat);
+  if (RandInt(0, 1) == 0) {
+    const StateId dead = lat.AddState();
+    for (StateId s = 1; s < dead; ++s) {
+      if (RandInt(0, 2) == 0)
+        lat.AddArc(s, LatticeArc(RandInt(1, 5), RandInt(0, 5), RandomWeight(),
+                                 dead));
+    }
+  }
+  Lattice folded;
+  FoldCtcBlanks(lat, &folded);
+  for (StateId s = 0; s < folded.NumStates(); ++s) {
+    for (fst::ArcIterator<Lattice> aiter(folded, s); !aiter.Done();
+         aiter.Next()) {
+      const LatticeArc& arc = aiter.Value();
+      KALDI_ASSERT(arc.ilabel != 0 && arc.ilabel == arc.olabel);
+    }
+  }
+  Lattice expected(lat);
+  fst::Project(&expected, fst::PROJECT_OUTPUT);
+  fst::RmEpsilon(&expected);
+  fst::Connect(&expected);
+  AssertSameTranscriptions(expected, folded);
+}
+
+// Add the paths of the acyclic lattice from state s, with the given prefix
+// of output labels (without epsilons) and cost, to paths.
+static void GetPathCosts(
+    const Lattice& lat, StateId s, BaseFloat graph_scale,
+    BaseFloat acoustic_scale, std::vector<int32>* prefix, double cost,
+    std::vector<std::pair<std::vector<int32>, double> >* paths) {
+  const LatticeWeight& f = lat.Final(s);
+  if (f != LatticeWeight::Zero()) {
+    paths->push_back(std::make_pair(
+        *prefix,
+        cost + graph_scale * f.Value1() + acoustic_scale * f.Value2()));
+  }
+  for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done(); aiter.Next()) {
+    const LatticeArc& arc = aiter.Value();
+    if (arc.olabel != 0) prefix->push_back(arc.olabel);
+    GetPathCosts(lat, arc.nextstate, graph_scale, acoustic_scale, prefix,
+                 cost + graph_scale * arc.weight.Value1() +
+                 acoustic_scale * arc.weight.Value2(),
+                 paths);
+    if (arc.olabel != 0) prefix->pop_back();
+  }
+}
+
+// SumSegmentations() must give one path per transcription, whose cost is the
+// log-sum of the scaled costs of all the paths of the transcription in the
+// input lattice (computed here by enumerating them).
+void UnitTestSumSegmentations() {
+  Lattice lat;
+  BuildRandomLattice(&lat);
+  const BaseFloat graph_scale = RandInt(1, 4) * 0.5,
+      acoustic_scale = RandInt(1, 4) * 0.25;
+  std::vector<int32> prefix;
+  std::vector<std::pair<std::vector<int32>, double> > paths;
+  GetPathCosts(lat, lat.Start(), graph_scale, acoustic_scale, &prefix, 0.0,
+               &paths);
+  std::map<std::vector<int32>, double> expected;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    std::map<std::vector<int32>, double>::iterator it =
+        expected.find(paths[i].first);
+    if (it == expected.end()) {
+      expected[paths[i].first] = paths[i].second;
+    } else {
+      it->second = -LogAdd(-it->second, -paths[i].second);
+    }
+  }
+  Lattice summed;
+  SumSegmentations(lat, graph_scale, acoustic_scale, &summed);
+  paths.clear();
+  if (summed.Start() != fst::kNoStateId)
+    GetPathCosts(summed, summed.Start(), 1.0, 1.0, &prefix, 0.0, &paths);
+  KALDI_ASSERT(paths.size() == expected.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    std::map<std::vector<int32>, double>::const_iterator it =
+        expected.find(paths[i].first);
+    KALDI_ASSERT(it != expected.end());
+    KALDI_ASSERT(std::abs(paths[i].second - it->second) <
+                 1e-3 * std::max(1.0, std::abs(it->second)));
+  }
+}
+
+}  // namespace kaldi
+
+int main() {
+  using namespace kaldi;
+  for (int i = 0; i < 20; ++i) {
+    UnitTestSortCtcLattice();
+    UnitTestDropAlignmentsSorted();
+    UnitTestDropAlignmentsLabels();
+    UnitTestSumSegmentations();
+    UnitTestFoldCtcBlanks();
+  }
+  std::cout << "Test OK.\n";
+  return 0;
+}
@@ -0,0 +1,219 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CTC_NBEST_H_
+#define CTC_NBEST_H_
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "fstext/determinize-lattice.h"
+#include "fstext/fstext-utils.h"
+#include "lat/kaldi-lattice.h"
+#include "lat/minimize-lattice.h"
+#include "lat/push-lattice.h"
+
+namespace kaldi {
+
+// Build an acceptor of the output labels of the lattice (the transcriptions),
+// in the semiring of Arc, whose weights are the total costs (graph plus
+// acoustic, with the given scales) of the lattice weights.
+template <class Arc>
+void ConvertToTranscriptionAcceptor(const Lattice& lat,
+                                    fst::VectorFst<Arc>* fst,
+                                    BaseFloat graph_scale = 1.0,
+                                    BaseFloat acoustic_scale = 1.0) {
+  typedef typename Arc::Weight Weight;
+  fst->DeleteStates();
+  const LatticeArc::StateId num_states = lat.NumStates();
+  fst->ReserveStates(num_states);
+  for (LatticeArc::StateId s = 0; s < num_states; ++s) {
+    fst->AddState();
+    const LatticeWeight& f = lat.Final(s);
+    if (f != LatticeWeight::Zero()) {
+      fst->SetFinal(s, Weight(graph_scale * f.Value1() +
+                              acoustic_scale * f.Value2()));
+    }
+    fst->ReserveArcs(s, lat.NumArcs(s));
+    for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+         aiter.Next()) {
+      const LatticeArc& arc = aiter.Value();
+      const Weight w(graph_scale * arc.weight.Value1() +
+                     acoustic_scale * arc.weight.Value2());
+      fst->AddArc(s, Arc(arc.olabel, arc.olabel, w, arc.nextstate));
+    }
+  }
+  if (lat.Start() != fst::kNoStateId) fst->SetStart(lat.Start());
+}
+
+// Deterministic acceptor of the transcriptions of the lattice, in the log
+// semiring: the cost of each transcription is the log-sum of the (scaled)
+// costs of all its paths, i.e. the sum over all its segmentations.
+inline void DeterminizeLogTranscriptions(
+    const Lattice& lat, BaseFloat graph_scale, BaseFloat acoustic_scale,
+    fst::VectorFst<fst::LogArc>* det) {
+  fst::VectorFst<fst::LogArc> fst;
+  ConvertToTranscriptionAcceptor(lat, &fst, graph_scale, acoustic_scale);
+  fst::RmEpsilon(&fst);
+  fst::Determinize(fst, det);
+}
+
+// Deterministic acceptor of the transcriptions of the lattice, in the
+// tropical semiring. The cost of each transcription is the cost of its best
+// path, or (if sum_alignments is true) the log-sum of the costs of all its
+// paths, i.e. the sum over all the segmentations of the transcription.
+inline void DeterminizeTranscriptions(const Lattice& lat,
+                                      const bool sum_alignments,
+                                      fst::StdVectorFst* det) {
+  if (sum_alignments) {
+    fst::VectorFst<fst::LogArc> log_det;
+    DeterminizeLogTranscriptions(lat, 1.0, 1.0, &log_det);
+    // Same costs, in the tropical semiring (for the shortest paths).
+    det->DeleteStates();
+    for (fst::LogArc::StateId s = 0; s < log_det.NumStates(); ++s) {
+      det->AddState();
+      det->SetFinal(s, fst::TropicalWeight(log_det.Final(s).Value()));
+      for (fst::ArcIterator<fst::VectorFst<fst::LogArc> > aiter(log_det, s);
+           !aiter.Done(); aiter.Next()) {
+        const fst::LogArc& arc = aiter.Value();
+        det->AddArc(s, fst::StdArc(arc.ilabel, arc.olabel,
+                                   fst::TropicalWeight(arc.weight.Value()),
+                                   arc.nextstate));
+      }
+    }
+    if (log_det.Start() != fst::kNoStateId) det->SetStart(log_det.Start());
+  } else {
+    fst::StdVectorFst fst;
+    ConvertToTranscriptionAcceptor(lat, &fst);
+    fst::RmEpsilon(&fst);
+    fst::Determinize(fst, det);
+  }
+}
+
+// Build a lattice with one path per transcription of lat, whose cost is the
+// log-sum of the costs of all its paths (segmentations), with the given
+// scales. The output is an acceptor of the transcriptions; since the graph
+// and acoustic costs can not be summed separately, the total costs are stored
+// as graph costs.
+//
+// The paths of a transcription (one per segmentation) go through different
+// states of the collapsed lattice, so their sum is a determinization in the
+// log semiring, which the collapse (a composition) can not do. Instead, the
+// scales are applied and the costs summed while the log-semiring acceptor is
+// built, and the determinized acceptor is written directly as a lattice, so
+// the only passes are the conversion, the epsilon removal and the
+// determinization.
+inline void SumSegmentations(const Lattice& lat, BaseFloat graph_scale,
+                             BaseFloat acoustic_scale, Lattice* out) {
+  fst::VectorFst<fst::LogArc> det;
+  DeterminizeLogTranscriptions(lat, graph_scale, acoustic_scale, &det);
+  out->DeleteStates();
+  out->ReserveStates(det.NumStates());
+  for (fst::LogArc::StateId s = 0; s < det.NumStates(); ++s) {
+    out->AddState();
+    const fst::LogWeight& f = det.Final(s);
+    if (f != fst::LogWeight::Zero())
+      out->SetFinal(s, LatticeWeight(f.Value(), 0.0));
+    out->ReserveArcs(s, det.NumArcs(s));
+    for (fst::ArcIterator<fst::VectorFst<fst::LogArc> > aiter(det, s);
+         !aiter.Done(); aiter.Next()) {
+      const fst::LogArc& arc = aiter.Value();
+      out->AddArc(s, LatticeArc(arc.ilabel, arc.olabel,
+                                LatticeWeight(arc.weight.Value(), 0.0),
+                                arc.nextstate));
+    }
+  }
+  if (det.Start() != fst::kNoStateId) out->SetStart(det.Start());
+}
+
+// Drop the alignments of the lattice (its input labels), keeping only the
+// transcriptions: the lattice becomes a minimal deterministic acceptor of its
+// output labels, with the cost of the best path of each transcription (graph
+// and acoustic costs are kept separately).
+// Returns false if the determinization exceeded the memory limits of opts,
+// in which case the lattice is only projected and epsilon-removed.
+inline bool DropAlignments(const fst::DeterminizeLatticeOptions& opts,
+                           Lattice* lat) {
+  // Project on the output labels, moved to the input side: the output labels
+  // become epsilon, so that the determinized lattice has empty strings.
+  for (LatticeArc::StateId s = 0; s < lat->NumStates(); ++s) {
+    for (fst::MutableArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+         aiter.Next()) {
+      LatticeArc arc = aiter.Value();
+      arc.ilabel = arc.olabel;
+      arc.olabel = 0;
+      aiter.SetValue(arc);
+    }
+  }
+  CompactLattice clat;
+  if (!fst::DeterminizeLattice<LatticeWeight, int32>(*lat, &clat, opts)) {
+    fst::Project(lat, fst::PROJECT_INPUT);
+    fst::RmEpsilon(lat);
+    return false;
+  }
+  fst::PushCompactLatticeWeights(&clat);
+  fst::MinimizeCompactLattice(&clat);
+  // The labels of clat are the output labels, and its strings are empty:
+  // ConvertLattice() puts the labels on the output side, and the result is
+  // projected to have them on both sides, as in the fallback above.
+  ConvertLattice(clat, lat);
+  fst::Project(lat, fst::PROJECT_OUTPUT);
+  return true;
+}
+
+// Get the n best distinct transcriptions of the lattice (output labels, with
+// epsilons removed), sorted by cost. See DeterminizeTranscriptions() for the
+// meaning of the costs.
+inline void GetNBestTranscriptions(
+    const Lattice& lat, const int32 n, const bool sum_alignments,
+    std::vector<std::vector<int32> >* transcriptions,
+    std::vector<double>* costs) {
+  transcriptions->clear();
+  costs->clear();
+  if (lat.Start() == fst::kNoStateId) return;
+  fst::StdVectorFst det, nbest;
+  DeterminizeTranscriptions(lat, sum_alignments, &det);
+  fst::ShortestPath(det, &nbest, n);
+  std::vector<fst::StdVectorFst> paths;
+  fst::ConvertNbestToVector(nbest, &paths);
+  std::vector<std::pair<double, size_t> > order;
+  std::vector<std::vector<int32> > words(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    std::vector<int32> isymbols;
+    fst::TropicalWeight weight;
+    fst::GetLinearSymbolSequence<fst::StdArc, int32>(paths[i], &isymbols,
+                                                     &words[i], &weight);
+    order.push_back(std::make_pair(weight.Value(), i));
+  }
+  std::sort(order.begin(), order.end());
+  for (size_t i = 0; i < order.size(); ++i) {
+    transcriptions->push_back(words[order[i].second]);
+    costs->push_back(order[i].first);
+  }
+}
+
+}  // namespace kaldi
+
+#endif  // CTC_NBEST_H_
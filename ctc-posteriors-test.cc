@@ -0,0 +1,200 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <map>
+
+#include "base/kaldi-common.h"
+#include "base/kaldi-math.h"
+#include "hmm/posterior.h"
+#include "lat/kaldi-lattice.h"
+#include "lat/lattice-functions.h"
+#include "ctc-blank-collapser.h"
+#include "ctc-posteriors.h"
+#include "grid-lattice.h"
+
+namespace kaldi {
+
+typedef LatticeArc::StateId StateId;
+typedef LatticeArc::Label Label;
+
+static LatticeWeight RandomWeight() {
+  return LatticeWeight(RandUniform() * 3, RandUniform() * 3);
+}
+
+// Random output label: one of the blanks or a symbol in [1, max_label].
+static Label RandomLabel(const std::vector<Label>& blanks, Label max_label) {
+  if (RandInt(0, 2) == 0) return blanks[RandInt(0, blanks.size() - 1)];
+  return RandInt(1, max_label);
+}
+
+// Random lattice of num_frames frames, as produced by a decoder: the states of
+// each frame are numbered after those of the previous one, and all the arcs
+// go to the next frame.
+static void RandomFrameLattice(const std::vector<Label>& blanks,
+                               Label max_label, int32 num_frames,
+                               Lattice* lat) {
+  lat->DeleteStates();
+  std::vector<StateId> prev(1, lat->AddState()), next;
+  lat->SetStart(prev[0]);
+  for (int32 t = 0; t < num_frames; ++t) {
+    next.clear();
+    const int32 num_states = RandInt(1, 3);
+    for (int32 i = 0; i < num_states; ++i) next.push_back(lat->AddState());
+    for (size_t i = 0; i < std::max(prev.size(), next.size()); ++i) {
+      const Label label = RandomLabel(blanks, max_label);
+      lat->AddArc(prev[i % prev.size()],
+                  LatticeArc(label, label, RandomWeight(),
+                             next[i % next.size()]));
+    }
+    for (size_t i = 0; i < prev.size(); ++i) {
+      const int32 num_arcs = RandInt(0, 2);
+      for (int32 a = 0; a < num_arcs; ++a) {
+        const Label label = RandomLabel(blanks, max_label);
+        lat->AddArc(prev[i], LatticeArc(label, label, RandomWeight(),
+                                        next[RandInt(0, num_states - 1)]));
+      }
+    }
+    prev.swap(next);
+  }
+  for (size_t i = 0; i < prev.size(); ++i)
+    lat->SetFinal(prev[i], RandomWeight());
+}
+
+// Random grid lattice (see GridLattice) of distinct labels in [1, max_label].
+static void RandomGridLattice(Label max_label, Lattice* lat) {
+  std::vector<Label> labels;
+  for (Label l = 1; l <= max_label; ++l)
+    if (RandInt(0, 1) == 0) labels.push_back(l);
+  if (labels.empty()) labels.push_back(RandInt(1, max_label));
+  lat->DeleteStates();
+  const int32 num_frames = RandInt(1, 8);
+  for (int32 t = 0; t <= num_frames; ++t) lat->AddState();
+  lat->SetStart(0);
+  for (int32 t = 0; t < num_frames; ++t) {
+    for (size_t v = 0; v < labels.size(); ++v)
+      lat->AddArc(t, LatticeArc(labels[v], labels[v], RandomWeight(), t + 1));
+  }
+  lat->SetFinal(num_frames, RandomWeight());
+}
+
+// Posteriors of the characters of the collapsed lattice, computed by
+// LatticeForwardBackward() on its output labels: every arc becomes an arc of
+// its output label, or of label dummy if it emits nothing (so that it still
+// takes a frame), whose posteriors are then dropped. Returns the total cost.
+static double ReferencePosteriors(const Lattice& collapsed, Label dummy,
+                                  std::vector<std::map<Label, double> >* post) {
+  Lattice lat(collapsed);
+  for (StateId s = 0; s < lat.NumStates(); ++s) {
+    for (fst::MutableArcIterator<Lattice> aiter(&lat, s); !aiter.Done();
+         aiter.Next()) {
+      LatticeArc arc = aiter.Value();
+      arc.ilabel = (arc.olabel == 0 ? dummy : arc.olabel);
+      aiter.SetValue(arc);
+    }
+  }
+  fst::TopSort(&lat);
+  Posterior arc_post;
+  const double loglike = LatticeForwardBackward(lat, &arc_post);
+  post->assign(arc_post.size(), std::map<Label, double>());
+  for (size_t t = 0; t < arc_post.size(); ++t) {
+    for (size_t i = 0; i < arc_post[t].size(); ++i) {
+      if (arc_post[t][i].first != dummy)
+        (*post)[t][arc_post[t][i].first] += arc_post[t][i].second;
+    }
+  }
+  return -loglike;
+}
+
+// The posteriors must be those of the reference, with the characters sorted
+// in each frame (characters with a zero posterior may be missing in either).
+static void AssertPosteriorsEqual(
+    const Posterior& post, const std::vector<std::map<Label, double> >& ref) {
+  KALDI_ASSERT(post.size() == ref.size());
+  for (size_t t = 0; t < post.size(); ++t) {
+    std::map<Label, double> expected(ref[t]);
+    for (size_t i = 0; i < post[t].size(); ++i) {
+      KALDI_ASSERT(i == 0 || post[t][i - 1].first < post[t][i].first);
+      const double p = expected[post[t][i].first];
+      KALDI_ASSERT(std::abs(post[t][i].second - p) < 1e-3);
+      expected.erase(post[t][i].first);
+    }
+    for (std::map<Label, double>::const_iterator it = expected.begin();
+         it != expected.end(); ++it)
+      KALDI_ASSERT(it->second < 1e-3);
+  }
+}
+
+// The posteriors computed without building the collapsed lattice must be
+// those computed by LatticeForwardBackward() on the collapsed lattice, for
+// random frame lattices (not grids).
+void UnitTestComputeCTCCharacterPosteriors() {
+  const Label max_label = RandInt(2, 10);
+  std::vector<Label> blanks(1, RandInt(1, max_label));
+  Lattice lat;
+  RandomFrameLattice(blanks, max_label, RandInt(1, 8), &lat);
+  Lattice collapsed;
+  DispatchingCtcBlankCollapser collapser((CtcBlankSet(blanks)));
+  collapser.Collapse(SoaLattice(lat), &collapsed);
+  std::vector<std::map<Label, double> > ref;
+  const double ref_total = ReferencePosteriors(collapsed, max_label + 1, &ref);
+  Posterior post;
+  const double total =
+      ComputeCTCCharacterPosteriors(lat, CtcBlankSet(blanks), &post);
+  KALDI_ASSERT(std::abs(total - ref_total) <
+               1e-4 * std::max(1.0, std::abs(ref_total)));
+  AssertPosteriorsEqual(post, ref);
+}
+
+// Same for ComputeGridCTCCharacterPosteriors() on grid lattices.
+void UnitTestComputeGridCTCCharacterPosteriors() {
+  const Label max_label = RandInt(2, 10);
+  std::vector<Label> blanks(1, RandInt(1, max_label));
+  Lattice lat;
+  RandomGridLattice(max_label, &lat);
+  GridLattice grid;
+  KALDI_ASSERT(grid.Init(lat));
+  Lattice collapsed;
+  DispatchingCtcBlankCollapser collapser((CtcBlankSet(blanks)));
+  collapser.Collapse(SoaLattice(lat), &collapsed);
+  std::vector<std::map<Label, double> > ref;
+  const double ref_total = ReferencePosteriors(collapsed, max_label + 1, &ref);
+  Posterior post;
+  const double total =
+      ComputeGridCTCCharacterPosteriors(grid, CtcBlankSet(blanks), &post);
+  KALDI_ASSERT(std::abs(total - ref_total) <
+               1e-4 * std::max(1.0, std::abs(ref_total)));
+  AssertPosteriorsEqual(post, ref);
+}
+
+}  // namespace kaldi
+
+int main() {
+  using namespace kaldi;
+  for (int i = 0; i < 100; ++i) {
+    UnitTestComputeCTCCharacterPosteriors();
+    UnitTestComputeGridCTCCharacterPosteriors();
+  }
+  std::cout << "Test OK.\n";
+  return 0;
+}
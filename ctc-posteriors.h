@@ -0,0 +1,219 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CTC_POSTERIORS_H_
+#define CTC_POSTERIORS_H_
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "hmm/posterior.h"
+#include "lat/kaldi-lattice.h"
+#include "lat/lattice-functions.h"
+#include "grid-lattice.h"
+#include "simd-kernels.h"
+
+namespace kaldi {
+
+// Log-add of two costs (negated log-probabilities).
+inline double LogAddCosts(double a, double b) {
+  const double inf = std::numeric_limits<double>::infinity();
+  if (a == inf) return b;
+  if (b == inf) return a;
+  return -LogAdd(-a, -b);
+}
+
+// ComputeCTCCharacterPosteriors() for grid lattices. On a grid, the paths
+// factorize by frame: the posterior of the arc v of frame t is its normalized
+// probability r(t, v) among the arcs of the frame, and its character is
+// emitted unless the previous frame has the same label, i.e. with posterior
+// r(t, v) * (1 - r(t - 1, v)). The normalization of each frame is a
+// vectorized log-sum (see SimdLogSumCosts()).
+inline double ComputeGridCTCCharacterPosteriors(
+    const GridLattice& grid, const CtcBlankSet& blanks, Posterior* post) {
+  typedef LatticeArc::Label Label;
+  const double inf = std::numeric_limits<double>::infinity();
+  const int32 num_frames = grid.NumFrames(), num_labels = grid.NumLabels();
+  const std::vector<Label>& labels = grid.Labels();
+  post->clear();
+  post->resize(num_frames);
+  // Arcs with characters, sorted by label.
+  std::vector<std::pair<Label, int32> > chars;
+  for (int32 v = 0; v < num_labels; ++v)
+    if (!blanks.IsBlank(labels[v]))
+      chars.push_back(std::make_pair(labels[v], v));
+  std::sort(chars.begin(), chars.end());
+  std::vector<float> costs(num_labels), probs(num_labels),
+      prev_probs(num_labels);
+  double total = static_cast<double>(grid.Final().Value1()) +
+      grid.Final().Value2();
+  for (int32 t = 0; t < num_frames && total != inf; ++t) {
+    grid.TotalCosts(t, &costs[0]);
+    double sum;
+    total += SimdLogSumCosts(&costs[0], num_labels, &probs[0], &sum);
+    if (total == inf) break;
+    const float scale = 1.0 / sum;
+    for (int32 v = 0; v < num_labels; ++v) probs[v] *= scale;
+    std::vector<std::pair<int32, BaseFloat> >& frame_post = (*post)[t];
+    frame_post.reserve(chars.size());
+    for (size_t i = 0; i < chars.size(); ++i) {
+      const int32 v = chars[i].second;
+      // Probability that the previous frame has a different label.
+      const float other = (t == 0 ? 1.0f : 1.0f - prev_probs[v]);
+      if (costs[v] != std::numeric_limits<float>::infinity() && other > 0.0f)
+        frame_post.push_back(std::make_pair(chars[i].first, probs[v] * other));
+    }
+    probs.swap(prev_probs);
+  }
+  if (total == inf) {
+    post->clear();
+    post->resize(num_frames);
+  }
+  return total;
+}
+
+// Computes the posterior probability of each character being emitted at each
+// frame, i.e. the posteriors of the arcs with non-epsilon output labels of
+// the lattice produced by RemoveCTCBlankFromLattice(), without building it.
+//
+// An output state (s, q) accepts the same paths as the input state s, so its
+// backward cost is that of s. Only the forward costs need to be split by the
+// last symbol read q (see CtcBlankCollapser). A character c is emitted by an
+// arc with label c leaving s at frame t whenever q != c, so its posterior at
+// t is the sum of alpha(s, q) * w(arc) * beta(nextstate) over all such arcs
+// and q, divided by the total probability of the lattice.
+//
+// The lattice must be topologically sorted, and its weights already scaled.
+// post is indexed by frame, with the characters sorted in each frame.
+// Returns the total cost of the lattice (infinity if it has no paths, in
+// which case post only has the empty frames).
+// Grid lattices are handled by ComputeGridCTCCharacterPosteriors().
+inline double ComputeCTCCharacterPosteriors(
+    const Lattice& lat, const CtcBlankSet& blanks, Posterior* post) {
+  typedef LatticeArc::StateId StateId;
+  typedef LatticeArc::Label Label;
+  const double inf = std::numeric_limits<double>::infinity();
+  GridLattice grid;
+  if (grid.Init(lat))
+    return ComputeGridCTCCharacterPosteriors(grid, blanks, post);
+  std::vector<int32> state_times;
+  const int32 num_frames = LatticeStateTimes(lat, &state_times);
+  post->clear();
+  post->resize(num_frames);
+  const StateId num_states = lat.NumStates();
+  if (lat.Start() == fst::kNoStateId) return inf;
+  // Backward costs of the input states.
+  std::vector<double> beta(num_states, inf);
+  for (StateId s = num_states - 1; s >= 0; --s) {
+    const LatticeWeight& f = lat.Final(s);
+    double b = (f == LatticeWeight::Zero() ? inf :
+                static_cast<double>(f.Value1()) + f.Value2());
+    for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+         aiter.Next()) {
+      const LatticeArc& arc = aiter.Value();
+      b = LogAddCosts(b, static_cast<double>(arc.weight.Value1()) +
+                      arc.weight.Value2() + beta[arc.nextstate]);
+    }
+    beta[s] = b;
+  }
+  const double total = beta[lat.Start()];
+  if (total == inf) return inf;
+  // Forward costs of the pairs (s, q). The contributions to each state are
+  // accumulated and combined when the state is reached.
+  std::vector<std::vector<std::pair<Label, double> > > alpha(num_states);
+  alpha[lat.Start()].push_back(std::make_pair(0, 0.0));
+  std::vector<std::map<Label, double> > frame_post(num_frames);
+  for (StateId s = 0; s < num_states; ++s) {
+    std::vector<std::pair<Label, double> >& as = alpha[s];
+    if (as.empty()) continue;
+    std::sort(as.begin(), as.end());
+    size_t n = 0;
+    for (size_t i = 1; i < as.size(); ++i) {
+      if (as[i].first == as[n].first) {
+        as[n].second = LogAddCosts(as[n].second, as[i].second);
+      } else {
+        as[++n] = as[i];
+      }
+    }
+    as.resize(n + 1);
+    // Forward cost of the input state s.
+    double a_s = inf;
+    for (size_t i = 0; i < as.size(); ++i) a_s = LogAddCosts(a_s, as[i].second);
+    const int32 t = state_times[s];
+    for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+         aiter.Next()) {
+      const LatticeArc& arc = aiter.Value();
+      const double w =
+          static_cast<double>(arc.weight.Value1()) + arc.weight.Value2();
+      std::vector<std::pair<Label, double> >& an = alpha[arc.nextstate];
+      if (arc.olabel == 0) {
+        for (size_t i = 0; i < as.size(); ++i)
+          an.push_back(std::make_pair(as[i].first, as[i].second + w));
+        continue;
+      }
+      if (blanks.IsBlank(arc.olabel)) {
+        an.push_back(std::make_pair(0, a_s + w));
+        continue;
+      }
+      an.push_back(std::make_pair(arc.olabel, a_s + w));
+      // Forward cost of the pairs that emit the character.
+      double a_emit = a_s;
+      const std::vector<std::pair<Label, double> >::const_iterator it =
+          std::lower_bound(as.begin(), as.end(),
+                           std::make_pair(arc.olabel, -inf));
+      if (it != as.end() && it->first == arc.olabel) {
+        // Remove the paths where the character is a repetition.
+        double a_other = inf;
+        for (size_t i = 0; i < as.size(); ++i)
+          if (as[i].first != arc.olabel)
+            a_other = LogAddCosts(a_other, as[i].second);
+        a_emit = a_other;
+      }
+      const double c = a_emit + w + beta[arc.nextstate] - total;
+      if (c != inf && t < num_frames) {
+        std::map<Label, double>::iterator pit = frame_post[t].find(arc.olabel);
+        if (pit == frame_post[t].end()) {
+          frame_post[t][arc.olabel] = c;
+        } else {
+          pit->second = LogAddCosts(pit->second, c);
+        }
+      }
+    }
+    std::vector<std::pair<Label, double> >().swap(as);
+  }
+  for (int32 t = 0; t < num_frames; ++t) {
+    for (std::map<Label, double>::const_iterator it = frame_post[t].begin();
+         it != frame_post[t].end(); ++it) {
+      (*post)[t].push_back(std::make_pair(
+          it->first, static_cast<BaseFloat>(Exp(-it->second))));
+    }
+  }
+  return total;
+}
+
+}  // namespace kaldi
+
+#endif  // CTC_POSTERIORS_H_
@@ -0,0 +1,351 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef GRID_LATTICE_H_
+#define GRID_LATTICE_H_
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "lat/kaldi-lattice.h"
+#include "ctc-blank-collapser.h"
+#include "simd-kernels.h"
+
+namespace kaldi {
+
+// Frame-synchronous "grid" lattice: states 0, ..., T (0 is the start state
+// and T the only final state), and the same V arcs leaving each state t < T
+// towards t + 1, with the same distinct non-epsilon labels (input and output
+// labels equal) in the same order. This is the lattice of the frame-level
+// outputs of a CTC model (see egs/input.txt).
+//
+// The costs are stored frame by frame in contiguous arrays (a T x V matrix),
+// so that the forward-backward passes, which factorize by frame on a grid,
+// are simple vectorized reductions over each frame (see simd-kernels.h).
+// Scaling, pruning and blank removal work directly on this matrix, which
+// takes a fraction of the memory of the VectorFst. Pruned arcs are kept in
+// the matrix with weight LatticeWeight::Zero(), and are not part of the
+// lattice.
+class GridLattice {
+ public:
+  typedef LatticeArc::StateId StateId;
+  typedef LatticeArc::Label Label;
+
+  GridLattice() : num_frames_(0), final_(LatticeWeight::Zero()) {}
+
+  // Copy the lattice, if it is a grid. Returns false otherwise.
+  bool Init(const Lattice& lat) {
+    const StateId num_states = lat.NumStates();
+    if (num_states < 2 || lat.Start() != 0) return false;
+    const size_t num_labels = lat.NumArcs(0);
+    if (num_labels == 0) return false;
+    for (StateId s = 1; s + 1 < num_states; ++s)
+      if (lat.NumArcs(s) != num_labels) return false;
+    const StateId last = num_states - 1;
+    if (lat.NumArcs(last) != 0 || lat.Final(last) == LatticeWeight::Zero())
+      return false;
+    num_frames_ = last;
+    labels_.clear();
+    graph_.resize(num_frames_ * num_labels);
+    acoustic_.resize(num_frames_ * num_labels);
+    size_t i = 0;
+    for (StateId s = 0; s < last; ++s) {
+      if (lat.Final(s) != LatticeWeight::Zero()) return false;
+      size_t v = 0;
+      for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+           aiter.Next(), ++v, ++i) {
+        const LatticeArc& arc = aiter.Value();
+        if (arc.nextstate != s + 1 || arc.ilabel != arc.olabel ||
+            arc.olabel == 0)
+          return false;
+        if (s == 0) {
+          labels_.push_back(arc.olabel);
+        } else if (arc.olabel != labels_[v]) {
+          return false;
+        }
+        graph_[i] = arc.weight.Value1();
+        acoustic_[i] = arc.weight.Value2();
+      }
+    }
+    std::vector<Label> sorted(labels_);
+    std::sort(sorted.begin(), sorted.end());
+    if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end())
+      return false;
+    final_ = lat.Final(last);
+    return true;
+  }
+
+  int32 NumFrames() const { return num_frames_; }
+  int32 NumLabels() const { return labels_.size(); }
+  // Labels of the arcs of each frame.
+  const std::vector<Label>& Labels() const { return labels_; }
+  const float* GraphCosts(int32 t) const {
+    return &graph_[static_cast<size_t>(t) * labels_.size()];
+  }
+  const float* AcousticCosts(int32 t) const {
+    return &acoustic_[static_cast<size_t>(t) * labels_.size()];
+  }
+  const LatticeWeight& Final() const { return final_; }
+
+  // Whether the arc v of frame t is part of the lattice (i.e. not pruned).
+  bool HasArc(int32 t, int32 v) const {
+    const size_t i = static_cast<size_t>(t) * labels_.size() + v;
+    return !(graph_[i] == std::numeric_limits<float>::infinity() &&
+             acoustic_[i] == std::numeric_limits<float>::infinity());
+  }
+
+  // Total (graph plus acoustic) costs of the arcs of frame t.
+  void TotalCosts(int32 t, float* costs) const {
+    SimdAdd(GraphCosts(t), AcousticCosts(t), labels_.size(), costs);
+  }
+
+  // Approximate memory (in bytes) used by the lattice.
+  size_t MemoryBytes() const {
+    return (graph_.size() + acoustic_.size()) * sizeof(float) +
+        labels_.size() * sizeof(Label);
+  }
+
+  // Scale the graph and acoustic costs, as fst::ScaleLattice() with
+  // fst::LatticeScale(graph_scale, acoustic_scale).
+  void Scale(BaseFloat graph_scale, BaseFloat acoustic_scale) {
+    const float inf = std::numeric_limits<float>::infinity();
+    // Scaling an infinite cost by 0 would give NaN, as in ScaleLattice()
+    // zero weights are kept.
+    for (size_t i = 0; i < graph_.size(); ++i) {
+      if (graph_[i] == inf) {
+        acoustic_[i] = inf;
+      } else {
+        graph_[i] *= graph_scale;
+        acoustic_[i] *= acoustic_scale;
+      }
+    }
+    if (final_ != LatticeWeight::Zero()) {
+      final_ = LatticeWeight(final_.Value1() * graph_scale,
+                             final_.Value2() * acoustic_scale);
+    }
+  }
+
+  // Same result as PruneLattice() (up to rounding). Since each frame of a
+  // grid is crossed by every path, the best path through an arc of frame t
+  // costs as much as the best path, plus the difference between the cost of
+  // the arc and the best cost of the frame. So the arcs within the beam are
+  // those within the beam of the best arc of their frame, and all the states
+  // are kept.
+  // Returns false if the lattice has no successful path (as PruneLattice()),
+  // in which case it is not modified.
+  bool Prune(BaseFloat beam) {
+    KALDI_ASSERT(beam > 0.0);
+    const double inf = std::numeric_limits<double>::infinity();
+    if (static_cast<double>(final_.Value1()) + final_.Value2() == inf)
+      return false;
+    const size_t num_labels = labels_.size();
+    std::vector<float> costs(num_labels), cutoffs(num_frames_);
+    for (int32 t = 0; t < num_frames_; ++t) {
+      TotalCosts(t, &costs[0]);
+      cutoffs[t] = SimdMin(&costs[0], num_labels);
+      if (cutoffs[t] == inf) return false;
+    }
+    for (int32 t = 0; t < num_frames_; ++t) {
+      TotalCosts(t, &costs[0]);
+      const double cutoff = static_cast<double>(cutoffs[t]) + beam;
+      float* graph = &graph_[static_cast<size_t>(t) * num_labels];
+      float* acoustic = &acoustic_[static_cast<size_t>(t) * num_labels];
+      for (size_t v = 0; v < num_labels; ++v) {
+        if (costs[v] > cutoff) {
+          graph[v] = std::numeric_limits<float>::infinity();
+          acoustic[v] = std::numeric_limits<float>::infinity();
+        }
+      }
+    }
+    return true;
+  }
+
+ private:
+  int32 num_frames_;
+  std::vector<Label> labels_;
+  // Costs of the arcs, frame by frame (T x V, row-major).
+  std::vector<float> graph_;
+  std::vector<float> acoustic_;
+  LatticeWeight final_;
+};
+
+// Prune the lattice with GridLattice::Prune(), if it is a grid. Returns
+// false (without modifying the lattice) if it is not a grid.
+inline bool PruneGridLattice(BaseFloat beam, Lattice* lat) {
+  typedef LatticeArc::StateId StateId;
+  GridLattice grid;
+  if (!grid.Init(*lat)) return false;
+  if (!grid.Prune(beam)) {
+    KALDI_WARN << "Lattice has no successful paths";
+    lat->DeleteStates();
+    return true;
+  }
+  std::vector<LatticeArc> arcs;
+  for (int32 t = 0; t < grid.NumFrames(); ++t) {
+    const StateId s = t;
+    arcs.clear();
+    int32 v = 0;
+    for (fst::ArcIterator<Lattice> aiter(*lat, s); !aiter.Done();
+         aiter.Next(), ++v) {
+      if (grid.HasArc(t, v)) arcs.push_back(aiter.Value());
+    }
+    if (arcs.size() == lat->NumArcs(s)) continue;
+    lat->DeleteArcs(s);
+    lat->ReserveArcs(s, arcs.size());
+    for (size_t a = 0; a < arcs.size(); ++a) lat->AddArc(s, arcs[a]);
+  }
+  return true;
+}
+
+// Output states of the collapsed grid (see CollapseGridLattice()) paired with
+// the states of each frame: the sorted states of C (0 for the blanks) reached
+// by the arcs of the previous frame, and the position among them of the state
+// reached by each arc.
+class GridCollapsedStates {
+ public:
+  typedef LatticeArc::Label Label;
+
+  GridCollapsedStates(const GridLattice& grid, const CtcBlankSet& blanks)
+      : grid_(grid), blanks_(blanks) {}
+
+  // Compute the C states paired with the state t + 1, i.e. reached by the
+  // arcs of frame t.
+  void Compute(int32 t) {
+    const std::vector<Label>& labels = grid_.Labels();
+    arcs_.clear();
+    for (int32 v = 0; v < grid_.NumLabels(); ++v) {
+      if (grid_.HasArc(t, v))
+        arcs_.push_back(std::make_pair(CState(labels[v]), v));
+    }
+    std::sort(arcs_.begin(), arcs_.end());
+    // The labels of a grid are distinct, so only the arcs with blanks can
+    // reach the same state.
+    states_.clear();
+    rank_.assign(grid_.NumLabels(), -1);
+    for (size_t k = 0; k < arcs_.size(); ++k) {
+      if (states_.empty() || states_.back() != arcs_[k].first)
+        states_.push_back(arcs_[k].first);
+      rank_[arcs_[k].second] = states_.size() - 1;
+    }
+  }
+
+  // Number of C states, and the C state of each one.
+  size_t Size() const { return states_.size(); }
+  Label State(size_t k) const { return states_[k]; }
+  // Position of the C state reached by the arc v (-1 if pruned).
+  int32 Rank(int32 v) const { return rank_[v]; }
+
+  Label CState(Label label) const {
+    return blanks_.IsBlank(label) ? 0 : label;
+  }
+
+ private:
+  const GridLattice& grid_;
+  const CtcBlankSet blanks_;
+  // C states reached by the arcs of the frame (and the arcs), sorted.
+  std::vector<std::pair<Label, int32> > arcs_;
+  std::vector<Label> states_;
+  std::vector<int32> rank_;
+};
+
+// Number of states and arcs of the lattice produced by CollapseGridLattice().
+inline void CountGridCollapsedSize(const GridLattice& grid,
+                                   const CtcBlankSet& blanks,
+                                   size_t* num_states, size_t* num_arcs) {
+  const std::vector<LatticeArc::Label>& labels = grid.Labels();
+  size_t prev = 1;
+  *num_states = 1;
+  *num_arcs = 0;
+  for (int32 t = 0; t < grid.NumFrames(); ++t) {
+    size_t n = 0, num_blanks = 0;
+    for (int32 v = 0; v < grid.NumLabels(); ++v) {
+      if (!grid.HasArc(t, v)) continue;
+      ++n;
+      num_blanks += blanks.IsBlank(labels[v]);
+    }
+    *num_arcs += prev * n;
+    // All the blanks reach the same state.
+    prev = n - (num_blanks > 1 ? num_blanks - 1 : 0);
+    *num_states += prev;
+  }
+}
+
+// Same lattice as RemoveCTCBlankFromLattice() (state by state identical),
+// built directly from the grid. The output states of frame t are the pairs
+// (t, q) of GridCollapsedStates, and all of them have a copy of the arcs of
+// the frame. If any frame has no arcs, the output is empty.
+inline void CollapseGridLattice(const GridLattice& grid,
+                                const CtcBlankSet& blanks, CtcArcSort sort,
+                                Lattice* out) {
+  typedef LatticeArc::StateId StateId;
+  typedef LatticeArc::Label Label;
+  out->DeleteStates();
+  const int32 num_frames = grid.NumFrames(), num_labels = grid.NumLabels();
+  const std::vector<Label>& labels = grid.Labels();
+  size_t num_states, num_arcs;
+  CountGridCollapsedSize(grid, blanks, &num_states, &num_arcs);
+  out->ReserveStates(num_states);
+  GridCollapsedStates states1(grid, blanks), states2(grid, blanks);
+  GridCollapsedStates* curr = &states1;
+  GridCollapsedStates* next = &states2;
+  // Output state of the first pair of the current frame.
+  StateId base = 0;
+  size_t curr_size = 1;
+  std::vector<LatticeArc> arcs;
+  for (int32 t = 0; t < num_frames; ++t) {
+    next->Compute(t);
+    if (next->Size() == 0) {
+      out->DeleteStates();
+      return;
+    }
+    const StateId next_base = base + curr_size;
+    for (size_t k = 0; k < curr_size; ++k) {
+      const Label q = (t == 0 ? 0 : curr->State(k));
+      arcs.clear();
+      const float* graph = grid.GraphCosts(t);
+      const float* acoustic = grid.AcousticCosts(t);
+      for (int32 v = 0; v < num_labels; ++v) {
+        if (next->Rank(v) < 0) continue;
+        const Label c = next->CState(labels[v]);
+        arcs.push_back(LatticeArc(labels[v], (c == 0 || c == q) ? 0 : c,
+                                  LatticeWeight(graph[v], acoustic[v]),
+                                  next_base + next->Rank(v)));
+      }
+      SortCtcArcs(sort, arcs.begin(), arcs.end());
+      const StateId o = out->AddState();
+      out->ReserveArcs(o, arcs.size());
+      for (size_t a = 0; a < arcs.size(); ++a) out->AddArc(o, arcs[a]);
+    }
+    std::swap(curr, next);
+    base = next_base;
+    curr_size = curr->Size();
+  }
+  for (size_t k = 0; k < curr_size; ++k)
+    out->SetFinal(out->AddState(), grid.Final());
+  out->SetStart(0);
+}
+
+}  // namespace kaldi
+
+#endif  // GRID_LATTICE_H_
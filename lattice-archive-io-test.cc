@@ -0,0 +1,107 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <unistd.h>
+
+#include "base/kaldi-common.h"
+#include "base/kaldi-math.h"
+#include "lat/kaldi-lattice.h"
+#include "lattice-archive-io.h"
+
+namespace kaldi {
+
+typedef LatticeArc::StateId StateId;
+
+static bool LatticesEqual(const Lattice& a, const Lattice& b) {
+  if (a.NumStates() != b.NumStates() || a.Start() != b.Start()) return false;
+  for (StateId s = 0; s < a.NumStates(); ++s) {
+    if (a.Final(s) != b.Final(s) || a.NumArcs(s) != b.NumArcs(s))
+      return false;
+    fst::ArcIterator<Lattice> aiter(a, s), biter(b, s);
+    for (; !aiter.Done(); aiter.Next(), biter.Next()) {
+      const LatticeArc& x = aiter.Value(), &y = biter.Value();
+      if (x.ilabel != y.ilabel || x.olabel != y.olabel ||
+          x.nextstate != y.nextstate || x.weight != y.weight)
+        return false;
+    }
+  }
+  return true;
+}
+
+// Random topologically sorted lattice, whose weights are written exactly in
+// text mode.
+static void RandomLattice(Lattice* lat) {
+  lat->DeleteStates();
+  const StateId num_states = RandInt(1, 10);
+  for (StateId s = 0; s < num_states; ++s) lat->AddState();
+  lat->SetStart(0);
+  for (StateId s = 0; s + 1 < num_states; ++s) {
+    const int32 num_arcs = RandInt(1, 3);
+    for (int32 a = 0; a < num_arcs; ++a) {
+      lat->AddArc(s, LatticeArc(RandInt(1, 50), RandInt(0, 50),
+                                LatticeWeight(RandInt(0, 40) * 0.25,
+                                              RandInt(0, 40) * 0.25),
+                                RandInt(s + 1, num_states - 1)));
+    }
+  }
+  lat->SetFinal(num_states - 1, LatticeWeight(RandInt(0, 4) * 0.25, 0.0));
+}
+
+// The lattices appended to an archive by LatticeArchiveAppender, in binary
+// or text mode, must be read back unchanged by MappedLatticeArchiveReader
+// (the binary ones are decoded directly from the mapped file).
+void UnitTestMappedLatticeArchiveReader() {
+  const std::string filename = "tmp-lattice-archive-io-test.ark";
+  unlink(filename.c_str());
+  std::vector<Lattice> lats(RandInt(1, 8));
+  std::vector<std::string> keys(lats.size());
+  for (size_t i = 0; i < lats.size(); ++i) {
+    RandomLattice(&lats[i]);
+    std::ostringstream key;
+    key << "lat-" << i;
+    keys[i] = key.str();
+    // Each appender opens the archive again, so the formats are mixed.
+    const std::string wspecifier = (RandInt(0, 1) == 0 ? "ark:" : "ark,t:");
+    LatticeArchiveAppender appender(wspecifier + filename);
+    appender.Write(keys[i], lats[i]);
+  }
+  MappedLatticeArchiveReader reader(filename, false);
+  for (size_t i = 0; i < lats.size(); ++i, reader.Next()) {
+    KALDI_ASSERT(!reader.Done());
+    KALDI_ASSERT(reader.Key() == keys[i]);
+    // The lattices that are skipped are not decoded.
+    if (RandInt(0, 3) != 0)
+      KALDI_ASSERT(LatticesEqual(reader.Value(), lats[i]));
+  }
+  KALDI_ASSERT(reader.Done());
+  KALDI_ASSERT(reader.Close());
+  unlink(filename.c_str());
+}
+
+}  // namespace kaldi
+
+int main() {
+  using namespace kaldi;
+  for (int i = 0; i < 20; ++i) UnitTestMappedLatticeArchiveReader();
+  std::cout << "Test OK.\n";
+  return 0;
+}
@@ -0,0 +1,419 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef LATTICE_ARCHIVE_IO_H_
+#define LATTICE_ARCHIVE_IO_H_
+
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include "lat/kaldi-lattice.h"
+#include "mapped-file.h"
+
+namespace kaldi {
+
+// Read the keys of all the complete lattices in a (possibly truncated) Kaldi
+// archive file, and truncate the file right after the last complete lattice,
+// so that new lattices can be appended to it.
+// Lattices in the archive may be written in binary or text mode.
+// Returns the number of complete lattices found.
+inline size_t ScanAndTruncateLatticeArchive(
+    const std::string& filename, std::unordered_set<std::string>* keys) {
+  std::ifstream is(filename.c_str(), std::ios::in | std::ios::binary);
+  if (!is.is_open()) return 0;  // Nothing written yet.
+  std::streamoff valid_end = 0;
+  size_t num_lattices = 0;
+  std::string key;
+  LatticeHolder holder;
+  while (is >> key) {
+    // Kaldi archives have a single space between the key and the object.
+    if (is.get() != ' ') break;
+    try {
+      if (!holder.Read(is)) break;
+    } catch (const std::exception& e) {
+      break;
+    }
+    holder.Clear();
+    const std::streamoff end = is.tellg();
+    if (end < 0) break;
+    valid_end = end;
+    keys->insert(key);
+    ++num_lattices;
+  }
+  is.close();
+  if (truncate(filename.c_str(), static_cast<off_t>(valid_end)) != 0) {
+    KALDI_ERR << "Could not truncate archive " << filename << " to "
+              << valid_end << " bytes";
+  }
+  KALDI_LOG << "Found " << num_lattices << " complete lattices in "
+            << filename << " (" << valid_end << " bytes)";
+  return num_lattices;
+}
+
+// Keep only the lines of a script file whose key is in the given set, so
+// that it matches the archive after ScanAndTruncateLatticeArchive().
+inline void FilterScriptFile(const std::string& filename,
+                             const std::unordered_set<std::string>& keys) {
+  std::ifstream is(filename.c_str());
+  if (!is.is_open()) return;
+  std::ostringstream kept;
+  std::unordered_set<std::string> seen;
+  std::string line;
+  while (std::getline(is, line)) {
+    const std::string key = line.substr(0, line.find(' '));
+    if (keys.count(key) && seen.insert(key).second) kept << line << '\n';
+  }
+  is.close();
+  std::ofstream os(filename.c_str(), std::ios::out | std::ios::trunc);
+  os << kept.str();
+  if (!os.good()) {
+    KALDI_ERR << "Could not rewrite script file " << filename;
+  }
+}
+
+// Appends lattices to an existing Kaldi archive (and, optionally, its script
+// file), in the same format used by LatticeWriter. LatticeWriter always
+// truncates its output, so this is used to resume interrupted runs.
+class LatticeArchiveAppender {
+ public:
+  // The wspecifier must be of the form ark[,opts]:filename or
+  // ark,scp[,opts]:filename,script_filename, with regular files as outputs.
+  explicit LatticeArchiveAppender(const std::string& wspecifier) {
+    WspecifierOptions opts;
+    const WspecifierType type = ClassifyWspecifier(
+        wspecifier, &archive_filename_, &script_filename_, &opts);
+    if (type != kArchiveWspecifier && type != kBothWspecifier) {
+      KALDI_ERR << "Appending is only supported for archives, but got "
+                << "wspecifier " << wspecifier;
+    }
+    if (ClassifyWxfilename(archive_filename_) != kFileOutput ||
+        (type == kBothWspecifier &&
+         ClassifyWxfilename(script_filename_) != kFileOutput)) {
+      KALDI_ERR << "Appending is only supported for regular files, but got "
+                << "wspecifier " << wspecifier;
+    }
+    binary_ = opts.binary;
+    flush_ = opts.flush;
+    archive_.open(archive_filename_.c_str(),
+                  std::ios::out | std::ios::binary | std::ios::app);
+    if (!archive_.is_open()) {
+      KALDI_ERR << "Could not open archive " << archive_filename_
+                << " for appending";
+    }
+    if (type == kBothWspecifier) {
+      script_.open(script_filename_.c_str(), std::ios::out | std::ios::app);
+      if (!script_.is_open()) {
+        KALDI_ERR << "Could not open script file " << script_filename_
+                  << " for appending";
+      }
+    }
+  }
+
+  void Write(const std::string& key, const Lattice& lat) {
+    if (!IsToken(key)) KALDI_ERR << "Invalid key " << key;
+    archive_ << key << ' ';
+    const std::streamoff offset = archive_.tellp();
+    if (!LatticeHolder::Write(archive_, binary_, lat)) {
+      KALDI_ERR << "Error writing lattice " << key << " to "
+                << archive_filename_;
+    }
+    if (script_.is_open()) {
+      script_ << key << ' ' << archive_filename_ << ':' << offset << '\n';
+    }
+    if (flush_) {
+      archive_.flush();
+      if (script_.is_open()) script_.flush();
+    }
+    if (!archive_.good() || (script_.is_open() && !script_.good())) {
+      KALDI_ERR << "Error writing lattice " << key << " to "
+                << archive_filename_;
+    }
+  }
+
+  const std::string& ArchiveFilename() const { return archive_filename_; }
+  const std::string& ScriptFilename() const { return script_filename_; }
+
+ private:
+  std::string archive_filename_;
+  std::string script_filename_;
+  bool binary_;
+  bool flush_;
+  std::ofstream archive_;
+  std::ofstream script_;
+};
+
+// Sequential reader of lattice archives that memory-maps the whole archive
+// file. Lattices written in binary mode as VectorFst<LatticeArc> (the format
+// used by LatticeWriter) are decoded directly from the mapped memory, copying
+// whole arc records at once; lattices in any other format (text, compact
+// lattices) are parsed in place with LatticeHolder::Read().
+// The lattice is only built when Value() is called, so skipping keys (e.g.
+// with --shard or --resume) is cheap.
+// It has the same interface as SequentialLatticeReader.
+class MappedLatticeArchiveReader {
+ public:
+  MappedLatticeArchiveReader(const std::string& filename, bool permissive)
+      : file_(filename), filename_(filename), permissive_(permissive),
+        pos_(0), done_(false), failed_(false), value_ready_(false),
+        record_begin_(0),
+        binary_record_(false), start_(-1), num_states_(0), states_begin_(0) {
+    Next();
+  }
+
+  bool Done() const { return done_; }
+
+  // Returns false if the reading stopped because of an error (even if the
+  // reader is permissive), i.e. the archive was not read to the end.
+  bool Close() const { return !failed_; }
+
+  const std::string& Key() const { return key_; }
+
+  Lattice& Value() {
+    if (!value_ready_) {
+      if (binary_record_) {
+        BuildBinaryLattice();
+      } else {
+        ParseLattice(record_begin_, &value_);
+      }
+      value_ready_ = true;
+    }
+    return value_;
+  }
+
+  void FreeCurrent() {
+    value_.DeleteStates();
+    value_ready_ = false;
+  }
+
+  void Next() {
+    FreeCurrent();
+    const char* data = file_.Data();
+    const size_t size = file_.Size();
+    while (pos_ < size && std::isspace(static_cast<unsigned char>(data[pos_])))
+      ++pos_;
+    if (pos_ >= size) {
+      done_ = true;
+      return;
+    }
+    const size_t key_begin = pos_;
+    while (pos_ < size && !std::isspace(static_cast<unsigned char>(data[pos_])))
+      ++pos_;
+    key_.assign(data + key_begin, pos_ - key_begin);
+    if (pos_ >= size || data[pos_] != ' ') {
+      Fail("no space after the key");
+      return;
+    }
+    ++pos_;
+    record_begin_ = pos_;
+    // Binary lattices start with the FST magic number (as checked by
+    // LatticeHolder::Read()), without the binary header of other objects.
+    binary_record_ = (pos_ < size && data[pos_] == kFstMagicByte &&
+                      ParseBinaryHeader(pos_));
+    if (binary_record_) {
+      if (!SkipBinaryStates()) Fail("truncated lattice");
+      return;
+    }
+    // Other formats are parsed here, to find where the lattice ends.
+    const size_t length = ParseLattice(record_begin_, &value_);
+    if (length == 0) return;
+    value_ready_ = true;
+    pos_ += length;
+  }
+
+ private:
+  // Parse the lattice starting at the given position with
+  // LatticeHolder::Read(), as SequentialLatticeReader does.
+  // Returns the number of bytes read, or 0 on error.
+  size_t ParseLattice(size_t begin, Lattice* value) {
+    MemoryStreamBuf buf(file_.Data() + begin, file_.Data() + file_.Size());
+    std::istream is(&buf);
+    LatticeHolder holder;
+    try {
+      if (!holder.Read(is)) {
+        Fail("could not read lattice");
+        return 0;
+      }
+    } catch (const std::exception& e) {
+      Fail(e.what());
+      return 0;
+    }
+    *value = holder.Value();
+    return buf.Position();
+  }
+
+  // Magic number at the beginning of OpenFst binary headers, and its first
+  // byte (it is stored in little-endian order).
+  static const int32 kFstMagicNumber = 2125659606;
+  static const char kFstMagicByte = static_cast<char>(214);
+  // Size of an arc in the OpenFst binary format: ilabel, olabel, the two
+  // floats of the weight and nextstate.
+  static const size_t kBinaryArcSize = 20;
+
+  template <typename T>
+  bool ReadBinary(size_t* pos, T* value) const {
+    if (*pos + sizeof(T) > file_.Size()) return false;
+    std::memcpy(value, file_.Data() + *pos, sizeof(T));
+    *pos += sizeof(T);
+    return true;
+  }
+
+  bool ReadBinaryString(size_t* pos, std::string* str) const {
+    int32 len = 0;
+    if (!ReadBinary(pos, &len) || len < 0 ||
+        *pos + len > file_.Size()) return false;
+    str->assign(file_.Data() + *pos, len);
+    *pos += len;
+    return true;
+  }
+
+  // Parse the OpenFst header of a binary lattice starting at the given
+  // position. Returns false if the lattice cannot be decoded directly (e.g.
+  // it is a compact lattice, or it has symbol tables).
+  bool ParseBinaryHeader(size_t pos) {
+    int32 magic = 0, version = 0, flags = 0;
+    uint64 properties = 0;
+    int64 num_arcs = 0;
+    std::string fst_type, arc_type;
+    if (!ReadBinary(&pos, &magic) || magic != kFstMagicNumber ||
+        !ReadBinaryString(&pos, &fst_type) || fst_type != "vector" ||
+        !ReadBinaryString(&pos, &arc_type) || arc_type != "lattice4" ||
+        !ReadBinary(&pos, &version) || !ReadBinary(&pos, &flags) ||
+        !ReadBinary(&pos, &properties) || !ReadBinary(&pos, &start_) ||
+        !ReadBinary(&pos, &num_states_) || !ReadBinary(&pos, &num_arcs)) {
+      return false;
+    }
+    // Symbol tables and aligned layouts are left to ReadLattice().
+    if (flags != 0 || num_states_ < 0) return false;
+    states_begin_ = pos;
+    return true;
+  }
+
+  // Move pos_ to the end of the current binary lattice.
+  bool SkipBinaryStates() {
+    size_t pos = states_begin_;
+    for (int64 s = 0; s < num_states_; ++s) {
+      int64 narcs = 0;
+      pos += 2 * sizeof(float);
+      if (!ReadBinary(&pos, &narcs) || narcs < 0) return false;
+      pos += narcs * kBinaryArcSize;
+      if (pos > file_.Size()) return false;
+    }
+    pos_ = pos;
+    return true;
+  }
+
+  // True if LatticeArc has exactly the layout of the binary arc records, so
+  // that they can be copied in bulk.
+  static bool ArcLayoutMatches() {
+    if (sizeof(LatticeArc) != kBinaryArcSize) return false;
+    const LatticeArc arc(1, 2, LatticeWeight(3.0, 4.0), 5);
+    char expected[kBinaryArcSize];
+    const int32 ilabel = 1, olabel = 2, nextstate = 5;
+    const float value1 = 3.0, value2 = 4.0;
+    std::memcpy(expected, &ilabel, 4);
+    std::memcpy(expected + 4, &olabel, 4);
+    std::memcpy(expected + 8, &value1, 4);
+    std::memcpy(expected + 12, &value2, 4);
+    std::memcpy(expected + 16, &nextstate, 4);
+    return std::memcmp(&arc, expected, kBinaryArcSize) == 0;
+  }
+
+  void BuildBinaryLattice() {
+    static const bool bulk_copy = ArcLayoutMatches();
+    const char* data = file_.Data();
+    size_t pos = states_begin_;
+    value_.DeleteStates();
+    value_.ReserveStates(num_states_);
+    for (int64 s = 0; s < num_states_; ++s) {
+      float value1, value2;
+      int64 narcs;
+      ReadBinary(&pos, &value1);
+      ReadBinary(&pos, &value2);
+      ReadBinary(&pos, &narcs);
+      const LatticeArc::StateId state = value_.AddState();
+      value_.SetFinal(state, LatticeWeight(value1, value2));
+      value_.ReserveArcs(state, narcs);
+      if (bulk_copy) {
+        arcs_.resize(narcs);
+        if (narcs > 0)
+          std::memcpy(&arcs_[0], data + pos, narcs * kBinaryArcSize);
+        for (const LatticeArc& arc : arcs_) value_.AddArc(state, arc);
+        pos += narcs * kBinaryArcSize;
+      } else {
+        for (int64 a = 0; a < narcs; ++a) {
+          int32 ilabel, olabel, nextstate;
+          ReadBinary(&pos, &ilabel);
+          ReadBinary(&pos, &olabel);
+          ReadBinary(&pos, &value1);
+          ReadBinary(&pos, &value2);
+          ReadBinary(&pos, &nextstate);
+          value_.AddArc(state, LatticeArc(ilabel, olabel,
+                                          LatticeWeight(value1, value2),
+                                          nextstate));
+        }
+      }
+    }
+    if (start_ >= 0) value_.SetStart(start_);
+  }
+
+  void Fail(const std::string& reason) {
+    done_ = true;
+    failed_ = true;
+    if (permissive_) {
+      KALDI_WARN << "Error reading archive " << filename_ << " at byte "
+                 << pos_ << " (" << reason << "), stopping here.";
+    } else {
+      KALDI_ERR << "Error reading archive " << filename_ << " at byte "
+                << pos_ << ": " << reason;
+    }
+  }
+
+  MappedFile file_;
+  std::string filename_;
+  bool permissive_;
+  size_t pos_;
+  bool done_;
+  bool failed_;
+  std::string key_;
+  Lattice value_;
+  bool value_ready_;
+  size_t record_begin_;
+  bool binary_record_;
+  // Binary header of the current lattice
+  int64 start_;
+  int64 num_states_;
+  size_t states_begin_;
+  std::vector<LatticeArc> arcs_;
+};
+
+}  // namespace kaldi
+
+#endif  // LATTICE_ARCHIVE_IO_H_
@@ -27,55 +27,721 @@
 #include "lat/kaldi-lattice.h"
 #include "lat/lattice-functions.h"
 #include "fstext/determinize-lattice.h"
+#include "adaptive-beam.h"
+#include "ctc-blank-collapser.h"
+#include "ctc-nbest.h"
+#include "ctc-posteriors.h"
+#include "grid-lattice.h"
+#include "lattice-archive-io.h"
+#include "lattice-server.h"
+#include "mapped-file.h"
+#include "parallel-ctc-blank-collapser.h"
+#include "parallel-lattice-prune.h"
+#include "soa-lattice.h"
 
 namespace kaldi {
 
+// Remove the CTC blanks from the output labels of the topologically sorted
+// lattice, i.e. compute compose(inp, C), using the given collapser (see
+// CtcBlankCollapser).
+// If the parallel collapser is given, it is used when the lattice allows it
+// (only with the standard CTC topology).
 void RemoveCTCBlankFromLattice(
-    const Lattice& inp, const LatticeArc::Label blank, Lattice* out) {
+    const SoaLattice& inp, DispatchingCtcBlankCollapser* collapser,
+    ParallelCtcBlankCollapser* parallel, Lattice* out) {
+  const CtcTopology& topology = collapser->Topology();
+  if (parallel == NULL || topology.Type() != kCtcTopologyCtc ||
+      !parallel->Collapse(inp, out)) {
+    collapser->Collapse(inp, out);
+  }
+  // Like fst::Compose(), do not keep the states that cannot reach a final
+  // state.
+  if (topology.MayDropArcs() || !inp.IsCoAccessible()) fst::Connect(out);
+  // The states are numbered in topological order, and the arcs sorted as
+  // requested, by construction.
+  SetCtcCollapsedProperties(collapser->ArcSort(), out);
+}
+
+void RemoveCTCBlankFromLattice(
+    const Lattice& inp, const CtcBlankSet& blanks, Lattice* out) {
+  if (inp.Properties(fst::kTopSorted, true) != fst::kTopSorted) {
+    Lattice sorted(inp);
+    if (!fst::TopSort(&sorted)) KALDI_ERR << "Input lattice is cyclic";
+    RemoveCTCBlankFromLattice(sorted, blanks, out);
+    return;
+  }
+  DispatchingCtcBlankCollapser collapser(blanks);
+  RemoveCTCBlankFromLattice(SoaLattice(inp), &collapser, NULL, out);
+}
+
+// Rough estimate of the heap memory used by a state of a VectorFst (final
+// weight, arc vector bookkeeping, epsilon counts and the state pointer).
+static const size_t kLatticeStateBytes =
+    sizeof(LatticeWeight) + 2 * sizeof(size_t) + 4 * sizeof(void*);
+
+// Approximate memory (in bytes) used by a lattice with the given number of
+// states and arcs.
+inline size_t ApproxLatticeMemory(size_t num_states, size_t num_arcs) {
+  return num_states * kLatticeStateBytes + num_arcs * sizeof(LatticeArc);
+}
+
+// Approximate memory (in bytes) used by the given lattice.
+size_t ApproxLatticeMemory(const Lattice& lat) {
+  size_t num_arcs = 0;
+  for (fst::StateIterator<Lattice> siter(lat); !siter.Done(); siter.Next()) {
+    num_arcs += lat.NumArcs(siter.Value());
+  }
+  return ApproxLatticeMemory(lat.NumStates(), num_arcs);
+}
+
+// Estimate the memory that RemoveCTCBlankFromLattice() will need for the
+// output lattice, without building it.
+// If the input is not topologically sorted, a looser bound is returned.
+size_t EstimateCTCBlankRemovalMemory(
+    const Lattice& inp, const CtcBlankSet& blanks,
+    const CtcTopology& topology) {
   typedef LatticeArc::StateId StateId;
   typedef LatticeArc::Label Label;
-  // Get table mapping from output symbols from the output labels in the input
-  // lattice to states
-  std::unordered_map<Label, StateId> symbol2state;
-  for (fst::StateIterator<Lattice> siter(inp); !siter.Done(); siter.Next()) {
-    const StateId s = siter.Value();
-    for (fst::ArcIterator<Lattice> aiter(inp, s); !aiter.Done();
-         aiter.Next()) {
-      const LatticeArc& arc = aiter.Value();
-      const Label o = arc.olabel;
-      if (o != blank && o != 0 && symbol2state.count(o) == 0) {
-        symbol2state.insert(std::make_pair(o, symbol2state.size() + 1));
+  if (inp.Start() == fst::kNoStateId) return 0;
+  size_t num_states = 0, num_arcs = 0;
+  if (inp.Properties(fst::kTopSorted, true) != fst::kTopSorted) {
+    // Bound: every input state/arc paired with every state of C.
+    std::unordered_set<Label> symbols;
+    for (StateId s = 0; s < inp.NumStates(); ++s) {
+      for (fst::ArcIterator<Lattice> aiter(inp, s); !aiter.Done();
+           aiter.Next()) {
+        const Label o = aiter.Value().olabel;
+        if (o != 0 && !blanks.IsBlank(o)) symbols.insert(o);
+        ++num_arcs;
       }
     }
+    return ApproxLatticeMemory(inp.NumStates() * (symbols.size() + 1),
+                               num_arcs * (symbols.size() + 1));
+  }
+  CountCTCBlankRemovalSize(inp, blanks, topology, NULL, 0.0, &num_states,
+                           &num_arcs);
+  return ApproxLatticeMemory(num_states, num_arcs);
+}
+
+inline double MegaBytes(size_t bytes) {
+  return bytes / (1024.0 * 1024.0);
+}
+
+struct LatticeRemoveCtcBlankOptions {
+  BaseFloat acoustic_scale;
+  BaseFloat graph_scale;
+  BaseFloat beam;
+  bool only_best_segmentation;
+  bool sum_segmentations;
+  bool drop_alignments;
+  bool fold_blanks;
+  std::string sort_arcs;
+  std::string topology;
+  int32 hmm_loop_offset;
+  BaseFloat max_lattice_mem;
+  BaseFloat mem_fallback_beam;
+  int32 max_mem_retries;
+  int32 max_output_arcs;
+  BaseFloat target_arcs_per_frame;
+  int32 num_threads;
+
+  LatticeRemoveCtcBlankOptions()
+      : acoustic_scale(1.0), graph_scale(1.0),
+        beam(std::numeric_limits<BaseFloat>::infinity()),
+        only_best_segmentation(false), sum_segmentations(false),
+        drop_alignments(false), fold_blanks(false), sort_arcs("none"),
+        topology("ctc"), hmm_loop_offset(0), max_lattice_mem(0.0),
+        mem_fallback_beam(16.0), max_mem_retries(4), max_output_arcs(0),
+        target_arcs_per_frame(0.0), num_threads(1) {}
+
+  void Register(OptionsItf* opts) {
+    opts->Register("acoustic-scale", &acoustic_scale,
+                   "Scaling factor for acoustic likelihoods in the lattices.");
+    opts->Register("graph-scale", &graph_scale,
+                   "Scaling factor for graph probabilities in the lattices.");
+    opts->Register("beam", &beam, "Pruning beam (applied after acoustic "
+                   "scaling and adding the insertion penalty).");
+    opts->Register("only-best-segmentation", &only_best_segmentation,
+                   "If true, keep only the best character segmentation for "
+                   "each sequence.");
+    opts->Register("sum-segmentations", &sum_segmentations,
+                   "If true, keep one path per character sequence, whose "
+                   "cost is the log-sum of the (scaled) costs of all its "
+                   "segmentations. The output is an acceptor of character "
+                   "sequences, with the total costs stored as graph costs.");
+    opts->Register("drop-alignments", &drop_alignments,
+                   "If true, drop the frame-level alignments (input labels) "
+                   "of the output lattices: they become minimal "
+                   "deterministic acceptors of the character sequences, "
+                   "with the costs of their best segmentations.");
+    opts->Register("fold-blanks", &fold_blanks,
+                   "If true, fold the blank and repeated symbol arcs of the "
+                   "output lattices into the arcs with characters, and "
+                   "remove their dead states. The output lattices become "
+                   "epsilon-free acceptors of the characters (without "
+                   "alignments), but are not determinized.");
+    opts->Register("topology", &topology,
+                   "Rules that turn the frame-level symbols into output "
+                   "symbols: \"ctc\" (repeated symbols are collapsed unless "
+                   "separated by a blank), \"no-repeat\" (every non-blank "
+                   "symbol is emitted), \"blank-optional\" (repeated symbols "
+                   "are collapsed even across blanks) or \"hmm2\" (each "
+                   "symbol is emitted by its begin label, followed by its "
+                   "loop label, see --hmm-loop-offset).");
+    opts->Register("hmm-loop-offset", &hmm_loop_offset,
+                   "With --topology=hmm2, the loop label of each symbol l is "
+                   "l + hmm-loop-offset, and the labels larger than this "
+                   "offset are loop labels.");
+    opts->Register("sort-arcs", &sort_arcs,
+                   "Sort the arcs of the output lattices by \"ilabel\" or "
+                   "\"olabel\" (or \"none\"). The output lattices are "
+                   "always topologically sorted, and the corresponding "
+                   "properties are set, so that other tools do not need to "
+                   "sort them again.");
+    opts->Register("max-lattice-mem", &max_lattice_mem,
+                   "Maximum approximate memory (in MB) for the intermediate "
+                   "lattices of each utterance. When exceeded, the input "
+                   "lattice is pruned with a tighter beam, determinization "
+                   "is skipped, or the utterance is skipped, in that order. "
+                   "If <= 0, no limit is applied.");
+    opts->Register("mem-fallback-beam", &mem_fallback_beam,
+                   "Beam used for the first pruning attempt when "
+                   "--max-lattice-mem is exceeded and --beam is infinite. "
+                   "Each further attempt halves the beam.");
+    opts->Register("max-mem-retries", &max_mem_retries,
+                   "Maximum number of pruning attempts to fit an utterance "
+                   "within --max-lattice-mem before skipping it.");
+    opts->Register("max-output-arcs", &max_output_arcs,
+                   "If > 0, choose the pruning beam of each utterance (never "
+                   "looser than --beam) so that the output lattice has at "
+                   "most this number of arcs.");
+    opts->Register("target-arcs-per-frame", &target_arcs_per_frame,
+                   "If > 0, choose the pruning beam of each utterance (never "
+                   "looser than --beam) so that the output lattice has at "
+                   "most this number of arcs per frame. If both this and "
+                   "--max-output-arcs are given, the tighter one is used.");
+    opts->Register("num-threads", &num_threads,
+                   "Number of threads used to prune each lattice and remove "
+                   "its CTC blanks. Useful for very large lattices, which "
+                   "are processed by frames (pruning) or time slices (blank "
+                   "removal) in parallel.");
   }
-  // Create composition lattice, such that output = compose(input, C)
-  Lattice C;
-  for (size_t s = 0; s < symbol2state.size() + 1; ++s) {
-    C.SetFinal(C.AddState(), LatticeWeight::One());
-  }
-  C.SetStart(0);
-  // Self-loop in the blank state
-  C.AddArc(0, LatticeArc(blank, 0, LatticeWeight::One(), 0));
-  for (const std::pair<Label, StateId>& p : symbol2state) {
-    // Arc from the initial state to the symbol's state
-    C.AddArc(0, LatticeArc(p.first, p.first, LatticeWeight::One(), p.second));
-    // Self-loop in the symbol's state
-    C.AddArc(p.second, LatticeArc(p.first, 0, LatticeWeight::One(), p.second));
-    // Arc back to the blank state
-    C.AddArc(p.second, LatticeArc(blank, 0, LatticeWeight::One(), 0));
-    // Arc to all other symbol states
-    for (const std::pair<Label, StateId>& p2 : symbol2state) {
-      if (p.first != p2.first) {
-        C.AddArc(p.second, LatticeArc(p2.first, p2.first,
-                                      LatticeWeight::One(), p2.second));
+
+  CtcArcSort ArcSortType() const {
+    if (sort_arcs == "none") return kCtcArcSortNone;
+    if (sort_arcs == "ilabel") return kCtcArcSortILabel;
+    if (sort_arcs == "olabel") return kCtcArcSortOLabel;
+    KALDI_ERR << "Invalid --sort-arcs=" << sort_arcs
+              << " (expected none, ilabel or olabel)";
+    return kCtcArcSortNone;
+  }
+
+  CtcTopology Topology() const {
+    if (topology == "ctc") return CtcTopology(kCtcTopologyCtc);
+    if (topology == "no-repeat") return CtcTopology(kCtcTopologyNoRepeat);
+    if (topology == "blank-optional")
+      return CtcTopology(kCtcTopologyBlankOptional);
+    if (topology == "hmm2") {
+      if (hmm_loop_offset <= 0) {
+        KALDI_ERR << "--topology=hmm2 requires --hmm-loop-offset > 0";
       }
+      return CtcTopology(kCtcTopologyHmm2, hmm_loop_offset);
+    }
+    KALDI_ERR << "Invalid --topology=" << topology
+              << " (expected ctc, no-repeat, blank-optional or hmm2)";
+    return CtcTopology();
+  }
+
+  bool AdaptiveBeam() const {
+    return max_output_arcs > 0 || target_arcs_per_frame > 0.0;
+  }
+
+  size_t MaxLatticeMemBytes() const {
+    return max_lattice_mem > 0.0 ?
+        static_cast<size_t>(max_lattice_mem * 1024.0 * 1024.0) : 0;
+  }
+};
+
+// Keeps track of the peak (approximate) memory used by the lattices of the
+// processed utterances.
+class LatticeMemoryStats {
+ public:
+  LatticeMemoryStats() : peak_bytes_(0) {}
+
+  void Update(const std::string& key, size_t bytes) {
+    if (bytes > peak_bytes_) {
+      peak_bytes_ = bytes;
+      peak_key_ = key;
     }
   }
-  // Compute output lattice
-  fst::Compose(inp, C, out);
+
+  void Log() const {
+    if (peak_key_.empty()) return;
+    KALDI_LOG << "Peak approximate lattice memory: "
+              << MegaBytes(peak_bytes_) << " MB (lattice "
+              << peak_key_ << ")";
+  }
+
+ private:
+  size_t peak_bytes_;
+  std::string peak_key_;
+};
+
+// Prunes, removes CTC blanks and (optionally) determinizes lattices. It keeps
+// the caches shared among lattices and the memory statistics of the run.
+class LatticeCtcBlankRemover {
+ public:
+  LatticeCtcBlankRemover(const LatticeRemoveCtcBlankOptions& opts,
+                         const CtcBlankSet& blanks)
+      : opts_(opts), blanks_(blanks), topology_(opts.Topology()),
+        collapser_(blanks, opts.ArcSortType(), topology_),
+        parallel_collapser_(blanks, opts.num_threads, opts.ArcSortType()),
+        pruner_(opts.num_threads) {
+    if (opts.only_best_segmentation && opts.sum_segmentations) {
+      KALDI_ERR << "--only-best-segmentation and --sum-segmentations can "
+                << "not be used together";
+    }
+  }
+
+  // Process the given lattice (which is modified). If post is not NULL, it
+  // receives the posteriors of the characters emitted at each frame of the
+  // output lattice (see ComputeCTCCharacterPosteriors()).
+  // Returns false if the lattice could not be processed within the memory
+  // limits, in which case the utterance must be skipped.
+  bool Process(const std::string& key, Lattice* lat, Lattice* result,
+               Posterior* post = NULL) {
+    if (!RemoveBlanks(key, lat, result, post)) return false;
+    if (opts_.fold_blanks) {
+      Lattice folded;
+      FoldCtcBlanks(*result, &folded);
+      *result = folded;
+    }
+    if (opts_.drop_alignments &&
+        !DropAlignments(DeterminizeOptions(), result)) {
+      KALDI_WARN << "Determinization of lattice " << key << " exceeded "
+                 << "--max-lattice-mem=" << opts_.max_lattice_mem
+                 << ", its alignments were dropped without minimization";
+    }
+    // Lattices modified after the blank removal may need to be sorted
+    SortCtcLattice(collapser_.ArcSort(), result);
+    return true;
+  }
+
+  // Get the n best transcriptions of a lattice given by Process() (see
+  // GetNBestTranscriptions()), ranked with the acoustic and graph scales
+  // applied, as --sum-segmentations; the costs are also scaled.
+  void NBestTranscriptions(const Lattice& out, int32 n, bool sum_alignments,
+                           std::vector<std::vector<int32> >* transcriptions,
+                           std::vector<double>* costs) const {
+    // The lattices with summed segmentations are already scaled
+    if (opts_.sum_segmentations ||
+        (opts_.acoustic_scale == 1.0 && opts_.graph_scale == 1.0)) {
+      GetNBestTranscriptions(out, n, sum_alignments, transcriptions, costs);
+      return;
+    }
+    Lattice scaled(out);
+    fst::ScaleLattice(fst::LatticeScale(opts_.graph_scale,
+                                        opts_.acoustic_scale), &scaled);
+    GetNBestTranscriptions(scaled, n, sum_alignments, transcriptions, costs);
+  }
+
+  const LatticeMemoryStats& MemoryStats() const { return stats_; }
+
+ private:
+  const LatticeRemoveCtcBlankOptions opts_;
+  const CtcBlankSet blanks_;
+  const CtcTopology topology_;
+  DispatchingCtcBlankCollapser collapser_;
+  ParallelCtcBlankCollapser parallel_collapser_;
+  ParallelLatticePruner pruner_;
+  LatticeMemoryStats stats_;
+
+  // Prunes and removes the CTC blanks of the lattice (see Process()).
+  bool RemoveBlanks(const std::string& key, Lattice* lat, Lattice* result,
+                    Posterior* post);
+
+  // Prunes, computes the posteriors and removes the CTC blanks of a generic
+  // lattice, or of a grid (working on its cost matrix) into out.
+  bool CollapseLattice(const std::string& key, Lattice* lat, Lattice* out,
+                       Posterior* post);
+  bool CollapseGrid(const std::string& key, GridLattice* grid, Lattice* out,
+                    Posterior* post);
+
+  // Prune with tighter beams (starting from beam) until the estimated memory
+  // mem fits within --max-lattice-mem. prune(beam) prunes the lattice and
+  // returns the new estimate. Returns false if it does not fit.
+  bool PruneToFitMemory(const std::string& key, BaseFloat beam, size_t mem,
+                        const std::function<size_t(BaseFloat)>& prune);
+
+  // Keep the segmentations requested (all, the best one or their sum) of the
+  // collapsed lattice out, into result.
+  void SelectSegmentations(const std::string& key, Lattice* out,
+                           Lattice* result);
+
+  fst::DeterminizeLatticeOptions DeterminizeOptions() const {
+    fst::DeterminizeLatticeOptions det_opts;
+    const size_t max_mem = opts_.MaxLatticeMemBytes();
+    if (max_mem > 0) {
+      det_opts.max_mem = static_cast<int>(
+          std::min<size_t>(max_mem, std::numeric_limits<int>::max()));
+    }
+    return det_opts;
+  }
+
+  void Prune(BaseFloat beam, Lattice* lat) {
+    if (PruneGridLattice(beam, lat)) return;
+    if (opts_.num_threads > 1) {
+      pruner_.Prune(beam, lat);
+    } else {
+      PruneLattice(beam, lat);
+    }
+  }
+};
+
+bool LatticeCtcBlankRemover::RemoveBlanks(const std::string& key,
+                                          Lattice* lat, Lattice* result,
+                                          Posterior* post) {
+  // Make sure that lattice complies with all asumptions
+  const uint64_t properties =
+      lat->Properties(fst::kAcceptor | fst::kAcyclic, true);
+  if ((properties & fst::kAcceptor) != fst::kAcceptor) {
+    KALDI_ERR << "Lattice " << key << " is not an acceptor";
+  }
+  if ((properties & fst::kAcyclic) != fst::kAcyclic) {
+    KALDI_ERR << "Lattice " << key << " is not acyclic";
+  }
+  Lattice out;
+  // Grid lattices are processed on their cost matrix, and the VectorFst is
+  // released (the adaptive beams are only implemented for generic lattices)
+  GridLattice grid;
+  if (topology_.Type() == kCtcTopologyCtc && !opts_.AdaptiveBeam() &&
+      grid.Init(*lat)) {
+    lat->DeleteStates();
+    if (!CollapseGrid(key, &grid, &out, post)) return false;
+  } else if (!CollapseLattice(key, lat, &out, post)) {
+    return false;
+  }
+  SelectSegmentations(key, &out, result);
+  return true;
 }
 
-}  // namespace fst
+bool LatticeCtcBlankRemover::PruneToFitMemory(
+    const std::string& key, BaseFloat beam, size_t mem,
+    const std::function<size_t(BaseFloat)>& prune) {
+  const size_t max_mem = opts_.MaxLatticeMemBytes();
+  for (int32 retry = 0; max_mem > 0 && mem > max_mem; ++retry) {
+    // With a zero beam only the best paths are left, which can not be pruned
+    if (retry >= opts_.max_mem_retries || beam == 0.0) {
+      KALDI_WARN << "Skipping lattice " << key << ": it would need about "
+                 << MegaBytes(mem) << " MB, after " << retry
+                 << " pruning attempts (--max-lattice-mem="
+                 << opts_.max_lattice_mem << ")";
+      return false;
+    }
+    beam = (beam == std::numeric_limits<BaseFloat>::infinity() ?
+            opts_.mem_fallback_beam : beam * 0.5);
+    KALDI_WARN << "Lattice " << key << " would need about " << MegaBytes(mem)
+               << " MB (--max-lattice-mem=" << opts_.max_lattice_mem
+               << "), pruning with beam " << beam;
+    mem = prune(beam);
+  }
+  return true;
+}
+
+bool LatticeCtcBlankRemover::CollapseLattice(const std::string& key,
+                                             Lattice* lat, Lattice* out,
+                                             Posterior* post) {
+  const bool scaled =
+      (opts_.acoustic_scale != 1.0 || opts_.graph_scale != 1.0);
+  // Acoustic scale
+  if (scaled)
+    fst::ScaleLattice(fst::LatticeScale(opts_.graph_scale,
+                                        opts_.acoustic_scale), lat);
+  // Lattice prunning
+  BaseFloat beam = opts_.beam;
+  if (beam != std::numeric_limits<BaseFloat>::infinity())
+    Prune(beam, lat);
+  // The sizes of the output (and the state times) are computed on the
+  // topologically sorted lattice, which pruning keeps sorted
+  if (lat->Properties(fst::kTopSorted, true) != fst::kTopSorted &&
+      !fst::TopSort(lat)) {
+    KALDI_ERR << "Lattice " << key << " is not acyclic";
+  }
+  // Choose the beam that keeps the output lattice within the target size
+  if (opts_.AdaptiveBeam()) {
+    std::vector<int32> state_times;
+    const int32 num_frames = LatticeStateTimes(*lat, &state_times);
+    size_t max_arcs = std::numeric_limits<size_t>::max();
+    if (opts_.max_output_arcs > 0)
+      max_arcs = opts_.max_output_arcs;
+    if (opts_.target_arcs_per_frame > 0.0) {
+      max_arcs = std::min(max_arcs, static_cast<size_t>(
+          opts_.target_arcs_per_frame * std::max(num_frames, 1)));
+    }
+    std::vector<double> arc_gaps, final_gaps;
+    const double adaptive_beam = ComputeAdaptiveBeam(
+        *lat, blanks_, topology_, max_arcs, &arc_gaps, &final_gaps);
+    if (adaptive_beam < beam) {
+      // Prune with the same gaps that were counted, so that the output has
+      // at most max_arcs arcs (unless even the best paths do not fit)
+      beam = adaptive_beam;
+      KALDI_VLOG(1) << "Lattice " << key << ": pruning with adaptive beam "
+                    << beam << " (" << num_frames << " frames, at most "
+                    << max_arcs << " output arcs)";
+      PruneLatticeByGaps(arc_gaps, final_gaps, beam, lat);
+    }
+  }
+  const size_t mem = ApproxLatticeMemory(*lat) +
+      EstimateCTCBlankRemovalMemory(*lat, blanks_, topology_);
+  stats_.Update(key, mem);
+  // Prune with tighter beams until the output lattice fits in memory
+  if (!PruneToFitMemory(key, beam, mem, [this, lat](BaseFloat new_beam) {
+        Prune(new_beam, lat);
+        return ApproxLatticeMemory(*lat) +
+            EstimateCTCBlankRemovalMemory(*lat, blanks_, topology_);
+      })) {
+    return false;
+  }
+  // Character posteriors, from the scaled (and pruned) input lattice
+  if (post != NULL) {
+    if (lat->Properties(fst::kTopSorted, true) != fst::kTopSorted)
+      fst::TopSort(lat);
+    if (ComputeCTCCharacterPosteriors(*lat, blanks_, post) ==
+        std::numeric_limits<double>::infinity()) {
+      KALDI_WARN << "Lattice " << key << " has no successful paths, "
+                 << "writing empty posteriors";
+    }
+  }
+  // Put lattices in the original scale
+  if (scaled)
+    fst::ScaleLattice(fst::LatticeScale(1.0 / opts_.graph_scale,
+                                        1.0 / opts_.acoustic_scale), lat);
+  // Remove CTC Blanks from the output symbols, reading the input from arrays
+  // (the VectorFst is released)
+  if (lat->Properties(fst::kTopSorted, true) != fst::kTopSorted &&
+      !fst::TopSort(lat)) {
+    KALDI_ERR << "Lattice " << key << " is not acyclic";
+  }
+  const SoaLattice inp(*lat);
+  lat->DeleteStates();
+  RemoveCTCBlankFromLattice(
+      inp, &collapser_, opts_.num_threads > 1 ? &parallel_collapser_ : NULL,
+      out);
+  const size_t out_mem = ApproxLatticeMemory(*out);
+  stats_.Update(key, inp.MemoryBytes() + out_mem);
+  KALDI_VLOG(1) << "Lattice " << key << ": " << out->NumStates()
+                << " output states, about " << MegaBytes(out_mem) << " MB";
+  return true;
+}
+
+bool LatticeCtcBlankRemover::CollapseGrid(const std::string& key,
+                                          GridLattice* grid, Lattice* out,
+                                          Posterior* post) {
+  const bool scaled =
+      (opts_.acoustic_scale != 1.0 || opts_.graph_scale != 1.0);
+  if (scaled) grid->Scale(opts_.graph_scale, opts_.acoustic_scale);
+  const BaseFloat beam = opts_.beam;
+  if (beam != std::numeric_limits<BaseFloat>::infinity() &&
+      !grid->Prune(beam)) {
+    KALDI_WARN << "Lattice " << key << " has no successful paths";
+  }
+  size_t num_states, num_arcs;
+  CountGridCollapsedSize(*grid, blanks_, &num_states, &num_arcs);
+  const size_t mem =
+      grid->MemoryBytes() + ApproxLatticeMemory(num_states, num_arcs);
+  stats_.Update(key, mem);
+  if (!PruneToFitMemory(key, beam, mem, [this, grid](BaseFloat new_beam) {
+        grid->Prune(new_beam);
+        size_t num_states, num_arcs;
+        CountGridCollapsedSize(*grid, blanks_, &num_states, &num_arcs);
+        return grid->MemoryBytes() + ApproxLatticeMemory(num_states,
+                                                         num_arcs);
+      })) {
+    return false;
+  }
+  if (post != NULL &&
+      ComputeGridCTCCharacterPosteriors(*grid, blanks_, post) ==
+      std::numeric_limits<double>::infinity()) {
+    KALDI_WARN << "Lattice " << key << " has no successful paths, "
+               << "writing empty posteriors";
+  }
+  if (scaled)
+    grid->Scale(1.0 / opts_.graph_scale, 1.0 / opts_.acoustic_scale);
+  CollapseGridLattice(*grid, blanks_, collapser_.ArcSort(), out);
+  SetCtcCollapsedProperties(collapser_.ArcSort(), out);
+  const size_t out_mem = ApproxLatticeMemory(*out);
+  stats_.Update(key, grid->MemoryBytes() + out_mem);
+  KALDI_VLOG(1) << "Lattice " << key << ": grid of " << grid->NumFrames()
+                << " frames and " << grid->NumLabels() << " symbols, "
+                << out->NumStates() << " output states, about "
+                << MegaBytes(out_mem) << " MB";
+  return true;
+}
+
+void LatticeCtcBlankRemover::SelectSegmentations(const std::string& key,
+                                                 Lattice* out,
+                                                 Lattice* result) {
+  // Sum the costs of all the segmentations of each hypothesis, with the
+  // scales applied (as the posteriors)
+  if (opts_.sum_segmentations) {
+    SumSegmentations(*out, opts_.graph_scale, opts_.acoustic_scale, result);
+    stats_.Update(key, ApproxLatticeMemory(*out) +
+                  ApproxLatticeMemory(*result));
+    return;
+  }
+  // Determinize to keep only the best segmentation hypothesis
+  if (opts_.only_best_segmentation) {
+    fst::Invert(out);
+    Lattice out_det;
+    if (fst::DeterminizeLattice<LatticeWeight, int32>(*out, &out_det,
+                                                      DeterminizeOptions())) {
+      fst::Invert(&out_det);
+      stats_.Update(key, ApproxLatticeMemory(*out) +
+                    ApproxLatticeMemory(out_det));
+      *result = out_det;
+      return;
+    }
+    KALDI_WARN << "Determinization of lattice " << key << " exceeded "
+               << "--max-lattice-mem=" << opts_.max_lattice_mem
+               << ", writing all segmentations instead";
+    fst::Invert(out);
+  }
+  *result = *out;
+}
+
+// Read a single lattice (not a table) from the given rxfilename. Regular
+// files are memory-mapped and parsed in place.
+void ReadSingleLattice(const std::string& rxfilename, Lattice* lat) {
+  Lattice* tmp = NULL;
+  bool binary = false;
+  if (ClassifyRxfilename(rxfilename) == kFileInput) {
+    MappedFile file(rxfilename);
+    MemoryStreamBuf buf(file.Data(), file.Data() + file.Size());
+    std::istream is(&buf);
+    if (!InitKaldiInputStream(is, &binary) ||
+        !ReadLattice(is, binary, &tmp)) {
+      KALDI_ERR << "Could not read lattice from " << rxfilename;
+    }
+  } else {
+    Input ki(rxfilename, &binary);
+    if (!ReadLattice(ki.Stream(), binary, &tmp)) {
+      KALDI_ERR << "Could not read lattice from "
+                << PrintableRxfilename(rxfilename);
+    }
+  }
+  *lat = *tmp;
+  delete tmp;
+}
+
+// Sequential reader of the input lattices: either a regular Kaldi table
+// reader, or a memory-mapped archive reader (for archives in regular files).
+class InputLatticeReader {
+ public:
+  InputLatticeReader(const std::string& rspecifier, bool use_mmap)
+      : failed_(false) {
+    std::string rxfilename;
+    RspecifierOptions opts;
+    const RspecifierType type =
+        ClassifyRspecifier(rspecifier, &rxfilename, &opts);
+    if (opts.permissive) {
+      KALDI_WARN << "With a permissive rspecifier, the reading stops at the "
+                 << "first lattice that cannot be read, and the rest of "
+                 << rspecifier << " may be ignored without any error";
+    }
+    if (use_mmap && type == kArchiveRspecifier &&
+        ClassifyRxfilename(rxfilename) == kFileInput) {
+      mapped_.reset(new MappedLatticeArchiveReader(rxfilename,
+                                                   opts.permissive));
+    } else {
+      if (use_mmap) {
+        KALDI_WARN << "Memory-mapped reading is only supported for archive "
+                   << "files, using a regular reader for " << rspecifier;
+      }
+      table_.reset(new SequentialLatticeReader(rspecifier));
+    }
+  }
+
+  bool Done() {
+    return failed_ || (mapped_ ? mapped_->Done() : table_->Done());
+  }
+  std::string Key() { return mapped_ ? mapped_->Key() : table_->Key(); }
+  Lattice& Value() { return mapped_ ? mapped_->Value() : table_->Value(); }
+
+  void FreeCurrent() {
+    if (mapped_) mapped_->FreeCurrent(); else table_->FreeCurrent();
+  }
+
+  // Errors reading the next lattice end the reading, and are reported by
+  // Close().
+  void Next() {
+    try {
+      if (mapped_) mapped_->Next(); else table_->Next();
+    } catch (const std::exception& e) {
+      KALDI_WARN << "Error reading the input lattices: " << e.what();
+      failed_ = true;
+    }
+  }
+
+  // Returns false if the input could not be read to the end.
+  bool Close() {
+    if (failed_) return false;
+    return mapped_ ? mapped_->Close() : table_->Close();
+  }
+
+ private:
+  // Whether Next() failed.
+  bool failed_;
+  std::unique_ptr<SequentialLatticeReader> table_;
+  std::unique_ptr<MappedLatticeArchiveReader> mapped_;
+};
+
+// Parse a shard specification of the form "i/N", with 1 <= i <= N.
+void ParseShardSpec(const std::string& spec, int32* shard, int32* num_shards) {
+  std::vector<std::string> fields;
+  SplitStringToVector(spec, "/", false, &fields);
+  if (fields.size() != 2 || !ConvertStringToInteger(fields[0], shard) ||
+      !ConvertStringToInteger(fields[1], num_shards) ||
+      *num_shards < 1 || *shard < 1 || *shard > *num_shards) {
+    KALDI_ERR << "Invalid shard specification \"" << spec << "\", expected "
+              << "i/N with 1 <= i <= N";
+  }
+}
+
+// Parse a symbol given as an integer or, if a symbol table is given, as a
+// symbol of the table.
+LatticeArc::Label ParseSymbol(const std::string& str,
+                              const fst::SymbolTable* symbols) {
+  LatticeArc::Label label = 0;
+  if (ConvertStringToInteger(str, &label)) {
+    if (symbols != NULL && symbols->Find(label).empty()) {
+      KALDI_WARN << "Symbol " << label << " is not in the symbol table";
+    }
+    return label;
+  }
+  if (symbols == NULL) {
+    KALDI_ERR << "String \"" << str << "\" cannot be converted to an integer "
+              << "(use --symbol-table to give symbols by name)";
+  }
+  const int64 key = symbols->Find(str);
+  if (key == fst::kNoSymbol) {
+    KALDI_ERR << "Symbol \"" << str << "\" is not in the symbol table";
+  }
+  return static_cast<LatticeArc::Label>(key);
+}
+
+// Shard (in [1, num_shards]) of the given key. This depends only on the key
+// (FNV-1a hash), so that all processes agree on the partition regardless of
+// the order of the input.
+int32 KeyShard(const std::string& key, int32 num_shards) {
+  uint64 h = 14695981039346656037ULL;
+  for (const char c : key) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 1099511628211ULL;
+  }
+  return static_cast<int32>(h % static_cast<uint64>(num_shards)) + 1;
+}
+
+}  // namespace kaldi
 
 int main(int argc, char** argv) {
   try {
@@ -85,99 +751,303 @@ int main(int argc, char** argv) {
         "Remove CTC blank symbols from the output labels of Kaldi lattices.\n"
         "\n"
         "Usage: lattice-remove-ctc-blank blank-symbol lat-rspecifier lat-wspecifier\n"
-        " e.g.: lattice-remove-ctc-blank 32 ark:input.ark ark:output.ark\n";
+        "   or: lattice-remove-ctc-blank blank-symbol lat-rxfilename lat-wxfilename\n"
+        "   or: lattice-remove-ctc-blank --server=socket blank-symbol\n"
+        " e.g.: lattice-remove-ctc-blank 32 ark:input.ark ark:output.ark\n"
+        " e.g.: lattice-remove-ctc-blank 32 input.lat output.lat\n"
+        " e.g.: lattice-remove-ctc-blank --nbest=10 32 ark:input.ark ark,t:nbest.txt\n"
+        " e.g.: lattice-remove-ctc-blank --server=/tmp/ctc.sock 32\n"
+        " e.g.: lattice-remove-ctc-blank --symbol-table=chars.txt \"<ctc>\" "
+        "ark:input.ark ark:output.ark\n"
+        "\n"
+        "blank-symbol can be a colon-separated list of symbols (e.g. 32:33),\n"
+        "which are all removed and separate repeated symbols as the blank.\n";
 
     ParseOptions po(usage);
-    BaseFloat acoustic_scale = 1.0;
-    BaseFloat graph_scale = 1.0;
-    BaseFloat beam = std::numeric_limits<BaseFloat>::infinity();
-    bool only_best_segmentation = false;
-    po.Register("acoustic-scale", &acoustic_scale,
-                "Scaling factor for acoustic likelihoods in the lattices.");
-    po.Register("graph-scale", &graph_scale,
-                "Scaling factor for graph probabilities in the lattices.");
-    po.Register("beam", &beam, "Pruning beam (applied after acoustic scaling "
-                "and adding the insertion penalty).");
-    po.Register("only-best-segmentation", &only_best_segmentation,
-                "If true, keep only the best character segmentation for each "
-                "sequence.");
+    LatticeRemoveCtcBlankOptions opts;
+    bool skip_errors = false;
+    int32 max_skipped = -1;
+    bool resume = false;
+    std::string resume_keys_rxfilename;
+    std::string shard_str;
+    bool binary = true;
+    bool use_mmap = false;
+    std::string server_socket, connect_socket;
+    std::string posteriors_wspecifier;
+    int32 nbest = 0;
+    std::string nbest_cost = "best";
+    std::string nbest_costs_wspecifier;
+    std::string symbol_table_rxfilename;
+    opts.Register(&po);
+    po.Register("skip-errors", &skip_errors,
+                "If true, lattices that cannot be processed (e.g. they are "
+                "not acceptors or are cyclic) are skipped with a warning, "
+                "instead of aborting the whole run. Lattices that cannot be "
+                "read still abort it, since the rest of the input cannot be "
+                "read either.");
+    po.Register("max-skipped", &max_skipped,
+                "Exit with non-zero status if more than this number of "
+                "lattices are skipped (because of errors or memory limits). "
+                "If < 0, skipped lattices never cause a failure.");
+    po.Register("resume", &resume,
+                "If true, keep the lattices already written to the output "
+                "archive (and its script file, if any) by a previous run, "
+                "skip their keys and append only the rest. An incomplete "
+                "last lattice is discarded. The output must be a regular "
+                "archive file, e.g. ark:out.ark or ark,scp:out.ark,out.scp.");
+    po.Register("resume-keys", &resume_keys_rxfilename,
+                "File with a list of keys (one per line, only the first "
+                "field is used) that must be skipped, e.g. a checkpoint of "
+                "a previous run. Can be combined with --resume.");
+    po.Register("shard", &shard_str,
+                "If given as i/N (1 <= i <= N), process only the i-th of N "
+                "disjoint subsets of the input lattices, chosen by a hash of "
+                "their keys. Use ark,scp: outputs to get a key to byte "
+                "offset index of each shard; the script files of all shards "
+                "can be concatenated for random access to the whole output.");
+    po.Register("binary", &binary,
+                "Write the output lattice in binary mode (only applies when "
+                "the output is a single lattice, not a table).");
+    po.Register("mmap", &use_mmap,
+                "If true, memory-map input archives (ark:filename) and decode "
+                "binary lattices directly from memory, instead of parsing "
+                "them through input streams.");
+    po.Register("server", &server_socket,
+                "Run as a server listening on this Unix domain socket: "
+                "lattices are received and returned in Kaldi binary format, "
+                "and caches are kept across requests. Only the blank-symbol "
+                "argument is expected.");
+    po.Register("connect", &connect_socket,
+                "Send the input lattices to the server listening on this "
+                "Unix domain socket, instead of processing them locally. "
+                "Processing options are those of the server.");
+    po.Register("write-posteriors", &posteriors_wspecifier,
+                "Wspecifier for the posteriors of the characters emitted at "
+                "each frame of the output lattices (computed with the "
+                "acoustic and graph scales), e.g. for confusion networks. "
+                "Only for tables, and not with --connect or --resume.");
+    po.Register("nbest", &nbest,
+                "If > 0, write the n best distinct transcriptions of each "
+                "output lattice (as integer vectors, with keys <key>-1, "
+                "<key>-2, ...) to the output wspecifier, instead of the "
+                "lattices. Only for tables.");
+    po.Register("nbest-cost", &nbest_cost,
+                "Cost of each transcription given by --nbest: \"best\" "
+                "(cost of its best segmentation) or \"sum\" (log-sum of the "
+                "costs of all its segmentations).");
+    po.Register("write-nbest-costs", &nbest_costs_wspecifier,
+                "Wspecifier for the costs of the transcriptions given by "
+                "--nbest (graph plus acoustic costs, scaled by "
+                "--graph-scale and --acoustic-scale, with the same keys).");
+    po.Register("symbol-table", &symbol_table_rxfilename,
+                "Symbol table (text format) of the output labels of the "
+                "lattices. If given, the blank-symbol argument can be a "
+                "symbol of the table instead of an integer.");
     po.Read(argc, argv);
 
-    if (po.NumArgs() != 3) {
+    if (po.NumArgs() != (server_socket.empty() ? 3 : 1)) {
       po.PrintUsage();
       exit(1);
     }
 
-    // Scaling scores
-    std::vector<std::vector<double> > scale(2, std::vector<double>{0.0, 0.0});
-    scale[0][0] = graph_scale;
-    scale[1][1] = acoustic_scale;
-
-    std::vector<std::vector<double> > inv_scale(2, std::vector<double>{0.0, 0.0});
-    inv_scale[0][0] = 1.0 / graph_scale;
-    inv_scale[1][1] = 1.0 / acoustic_scale;
-
     const std::string blank_symbol_str = po.GetArg(1);
-    const std::string lattice_in_str = po.GetArg(2);
-    const std::string lattice_out_str = po.GetArg(3);
+    const std::string lattice_in_str = po.GetOptArg(2);
+    const std::string lattice_out_str = po.GetOptArg(3);
     const bool lattice_in_is_table =
         (ClassifyRspecifier(lattice_in_str, NULL, NULL) != kNoRspecifier);
     const bool lattice_out_is_table =
         (ClassifyWspecifier(lattice_out_str, NULL, NULL, NULL) != kNoWspecifier);
 
-    LatticeArc::Label blank_symbol = 0;
-    if (!ConvertStringToInteger(blank_symbol_str, &blank_symbol)) {
-      KALDI_ERR << "String \"" << blank_symbol_str
-                << "\" cannot be converted to an integer";
+    std::unique_ptr<fst::SymbolTable> symbol_table;
+    if (!symbol_table_rxfilename.empty()) {
+      symbol_table.reset(fst::SymbolTable::ReadText(symbol_table_rxfilename));
+      if (!symbol_table) {
+        KALDI_ERR << "Could not read symbol table from "
+                  << PrintableRxfilename(symbol_table_rxfilename);
+      }
+    }
+    std::vector<std::string> blank_symbol_strs;
+    SplitStringToVector(blank_symbol_str, ":", true, &blank_symbol_strs);
+    std::vector<LatticeArc::Label> blank_symbol_labels;
+    for (size_t i = 0; i < blank_symbol_strs.size(); ++i) {
+      blank_symbol_labels.push_back(
+          ParseSymbol(blank_symbol_strs[i], symbol_table.get()));
+      if (blank_symbol_labels.back() == 0) {
+        KALDI_ERR << "Symbol 0 is reserved for epsilon!";
+      }
     }
-    if (blank_symbol == 0) {
-      KALDI_ERR << "Symbol 0 is reserved for epsilon!";
+    if (blank_symbol_labels.empty()) {
+      KALDI_ERR << "No blank symbol given";
     }
+    const CtcBlankSet blank_symbols(blank_symbol_labels);
 
 
-    if (lattice_in_is_table && lattice_out_is_table) {
-      SequentialLatticeReader lattice_reader(lattice_in_str);
-      LatticeWriter lattice_writer(lattice_out_str);
+    if (!posteriors_wspecifier.empty() &&
+        opts.Topology().Type() != kCtcTopologyCtc) {
+      KALDI_ERR << "--write-posteriors requires --topology=ctc";
+    }
+
+    if (nbest_cost != "best" && nbest_cost != "sum") {
+      KALDI_ERR << "Invalid --nbest-cost=" << nbest_cost
+                << " (expected best or sum)";
+    }
+
+    int32 shard = 1, num_shards = 1;
+    if (!shard_str.empty()) ParseShardSpec(shard_str, &shard, &num_shards);
+
+    if (!server_socket.empty()) {
+      LatticeCtcBlankRemover remover(opts, blank_symbols);
+      RunLatticeServer(server_socket, [&remover](
+          const std::string& key, Lattice* lat, Lattice* out,
+          std::string* error) {
+        if (remover.Process(key, lat, out)) return kLatticeServerOk;
+        *error = "Lattice " + key + " exceeds the memory limits";
+        return kLatticeServerSkipped;
+      });
+    } else if (lattice_in_is_table && lattice_out_is_table) {
+      // Keys processed by a previous run
+      std::unordered_set<std::string> done_keys;
+      if (!resume_keys_rxfilename.empty()) {
+        Input ki(resume_keys_rxfilename);
+        std::string line;
+        while (std::getline(ki.Stream(), line)) {
+          std::istringstream iss(line);
+          std::string key;
+          if (iss >> key) done_keys.insert(key);
+        }
+      }
+      InputLatticeReader lattice_reader(lattice_in_str, use_mmap);
+      std::unique_ptr<LatticeWriter> lattice_writer;
+      std::unique_ptr<LatticeArchiveAppender> lattice_appender;
+      std::unique_ptr<Int32VectorWriter> nbest_writer;
+      std::unique_ptr<BaseFloatWriter> nbest_cost_writer;
+      if (nbest > 0) {
+        if (resume) KALDI_ERR << "--nbest can not be combined with --resume";
+        nbest_writer.reset(new Int32VectorWriter(lattice_out_str));
+        if (!nbest_costs_wspecifier.empty())
+          nbest_cost_writer.reset(new BaseFloatWriter(nbest_costs_wspecifier));
+      } else if (resume) {
+        std::string archive_wxfilename, script_wxfilename;
+        const WspecifierType wtype = ClassifyWspecifier(
+            lattice_out_str, &archive_wxfilename, &script_wxfilename, NULL);
+        if ((wtype != kArchiveWspecifier && wtype != kBothWspecifier) ||
+            ClassifyWxfilename(archive_wxfilename) != kFileOutput) {
+          KALDI_ERR << "--resume requires an archive file as output, but got "
+                    << lattice_out_str;
+        }
+        std::unordered_set<std::string> written_keys;
+        ScanAndTruncateLatticeArchive(archive_wxfilename, &written_keys);
+        if (!script_wxfilename.empty())
+          FilterScriptFile(script_wxfilename, written_keys);
+        done_keys.insert(written_keys.begin(), written_keys.end());
+        lattice_appender.reset(new LatticeArchiveAppender(lattice_out_str));
+      } else {
+        lattice_writer.reset(new LatticeWriter(lattice_out_str));
+      }
+      LatticeCtcBlankRemover remover(opts, blank_symbols);
+      std::unique_ptr<PosteriorWriter> posterior_writer;
+      if (!posteriors_wspecifier.empty()) {
+        if (resume || !connect_socket.empty()) {
+          KALDI_ERR << "--write-posteriors can not be combined with "
+                    << "--resume or --connect";
+        }
+        posterior_writer.reset(new PosteriorWriter(posteriors_wspecifier));
+      }
+      std::unique_ptr<LatticeServerClient> client;
+      if (!connect_socket.empty())
+        client.reset(new LatticeServerClient(connect_socket));
+      int32 num_done = 0, num_skipped = 0, num_resumed = 0;
       for (; !lattice_reader.Done(); lattice_reader.Next()) {
-        // Read input lattice
         const std::string lattice_key = lattice_reader.Key();
-        Lattice lat = lattice_reader.Value();
-        lattice_reader.FreeCurrent();
-        // Make sure that lattice complies with all asumptions
-        const uint64_t properties =
-            lat.Properties(fst::kAcceptor | fst::kAcyclic, true);
-        if ((properties & fst::kAcceptor) != fst::kAcceptor) {
-          KALDI_ERR << "Lattice " << lattice_key << " is not an acceptor";
+        if (num_shards > 1 && KeyShard(lattice_key, num_shards) != shard) {
+          continue;
         }
-        if ((properties & fst::kAcyclic) != fst::kAcyclic) {
-          KALDI_ERR << "Lattice " << lattice_key << " is not acyclic";
+        if (done_keys.count(lattice_key)) {
+          ++num_resumed;
+          continue;
         }
-        // Acoustic scale
-        if (acoustic_scale != 1.0 || graph_scale != 1.0)
-          fst::ScaleLattice(scale, &lat);
-        // Lattice prunning
-        if (beam != std::numeric_limits<BaseFloat>::infinity())
-          PruneLattice(beam, &lat);
-        // Put lattices in the original scale
-        if (acoustic_scale != 1.0 || graph_scale != 1.0)
-          fst::ScaleLattice(inv_scale, &lat);
-        // Remove CTC Blanks from the output symbols
         Lattice out;
-        RemoveCTCBlankFromLattice(lat, blank_symbol, &out);
-        // Determinize to keep only the best segmentation hypothesis
-        if (only_best_segmentation) {
-          fst::Invert(&out);
-          Lattice out_det;
-          fst::DeterminizeLattice<LatticeWeight, int32>(out, &out_det);
-          fst::Invert(&out_det);
-          lattice_writer.Write(lattice_key, out_det);
+        Posterior post;
+        bool processed = false;
+        try {
+          // Read input lattice
+          Lattice lat = lattice_reader.Value();
+          lattice_reader.FreeCurrent();
+          if (client) {
+            std::string error;
+            const LatticeServerStatus status =
+                client->Process(lattice_key, lat, &out, &error);
+            if (status == kLatticeServerError) KALDI_ERR << error;
+            if (status == kLatticeServerSkipped) KALDI_WARN << error;
+            processed = (status == kLatticeServerOk);
+          } else {
+            processed = remover.Process(lattice_key, &lat, &out,
+                                        posterior_writer ? &post : NULL);
+          }
+        } catch (const std::exception& e) {
+          if (!skip_errors) throw;
+          KALDI_WARN << "Skipping lattice " << lattice_key << ": "
+                     << e.what();
+        }
+        if (processed && nbest_writer) {
+          std::vector<std::vector<int32> > transcriptions;
+          std::vector<double> costs;
+          remover.NBestTranscriptions(out, nbest, nbest_cost == "sum",
+                                      &transcriptions, &costs);
+          for (size_t i = 0; i < transcriptions.size(); ++i) {
+            std::ostringstream nbest_key;
+            nbest_key << lattice_key << "-" << (i + 1);
+            nbest_writer->Write(nbest_key.str(), transcriptions[i]);
+            if (nbest_cost_writer)
+              nbest_cost_writer->Write(nbest_key.str(), costs[i]);
+          }
+        } else if (processed) {
+          if (lattice_appender)
+            lattice_appender->Write(lattice_key, out);
+          else
+            lattice_writer->Write(lattice_key, out);
+        }
+        if (processed) {
+          if (posterior_writer) posterior_writer->Write(lattice_key, post);
+          ++num_done;
         } else {
-          lattice_writer.Write(lattice_key, out);
+          ++num_skipped;
         }
       }
+      remover.MemoryStats().Log();
+      KALDI_LOG << "Done " << num_done << " lattices, skipped "
+                << num_skipped << ", " << num_resumed
+                << " already done by a previous run.";
+      if (!lattice_reader.Close()) {
+        KALDI_WARN << "Could not read all the lattices of " << lattice_in_str
+                   << ", the lattices after the last one done are missing";
+        return 1;
+      }
+      if (max_skipped >= 0 && num_skipped > max_skipped) {
+        KALDI_WARN << "Skipped " << num_skipped << " lattices, more than "
+                   << "--max-skipped=" << max_skipped;
+        return 1;
+      }
+    } else if (!lattice_in_is_table && !lattice_out_is_table) {
+      if (!posteriors_wspecifier.empty() || nbest > 0) {
+        KALDI_ERR << "--write-posteriors and --nbest require table input "
+                  << "and output";
+      }
+      const std::string lattice_key = PrintableRxfilename(lattice_in_str);
+      Lattice lat;
+      ReadSingleLattice(lattice_in_str, &lat);
+      LatticeCtcBlankRemover remover(opts, blank_symbols);
+      Lattice out;
+      if (!remover.Process(lattice_key, &lat, &out)) return 1;
+      remover.MemoryStats().Log();
+      Output ko(lattice_out_str, binary);
+      if (!WriteLattice(ko.Stream(), binary, out)) {
+        KALDI_ERR << "Could not write lattice to "
+                  << PrintableWxfilename(lattice_out_str);
+      }
     } else {
-      KALDI_ERR << "Not implemented! Both input and output lattices must be "
-                << "Kaldi tables.";
+      KALDI_ERR << "Input and output lattices must be both Kaldi tables or "
+                << "both single lattices.";
     }
     return 0;
   } catch (const std::exception& e) {
@@ -0,0 +1,142 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "base/kaldi-common.h"
+#include "base/kaldi-math.h"
+#include "lat/kaldi-lattice.h"
+#include "lattice-server.h"
+
+namespace kaldi {
+
+typedef LatticeArc::StateId StateId;
+
+static bool LatticesEqual(const Lattice& a, const Lattice& b) {
+  if (a.NumStates() != b.NumStates() || a.Start() != b.Start()) return false;
+  for (StateId s = 0; s < a.NumStates(); ++s) {
+    if (a.Final(s) != b.Final(s) || a.NumArcs(s) != b.NumArcs(s))
+      return false;
+    fst::ArcIterator<Lattice> aiter(a, s), biter(b, s);
+    for (; !aiter.Done(); aiter.Next(), biter.Next()) {
+      const LatticeArc& x = aiter.Value(), &y = biter.Value();
+      if (x.ilabel != y.ilabel || x.olabel != y.olabel ||
+          x.nextstate != y.nextstate || x.weight != y.weight)
+        return false;
+    }
+  }
+  return true;
+}
+
+// Random topologically sorted lattice, with arbitrary float weights.
+static void RandomLattice(Lattice* lat) {
+  lat->DeleteStates();
+  const StateId num_states = RandInt(1, 10);
+  for (StateId s = 0; s < num_states; ++s) lat->AddState();
+  lat->SetStart(0);
+  for (StateId s = 0; s + 1 < num_states; ++s) {
+    const int32 num_arcs = RandInt(1, 3);
+    for (int32 a = 0; a < num_arcs; ++a) {
+      lat->AddArc(s, LatticeArc(RandInt(1, 50), RandInt(0, 50),
+                                LatticeWeight(RandUniform() * 10,
+                                              RandUniform() * 10),
+                                RandInt(s + 1, num_states - 1)));
+    }
+  }
+  lat->SetFinal(num_states - 1, LatticeWeight(RandUniform(), RandUniform()));
+}
+
+static void SendRequest(int fd, const std::string& key,
+                        const std::string& data) {
+  const uint32 key_length = key.size();
+  KALDI_ASSERT(WriteFully(fd, &key_length, sizeof(key_length)) &&
+               WriteFully(fd, key.data(), key.size()) &&
+               WriteFrame(fd, data));
+}
+
+static LatticeServerStatus ReadResponse(int fd, std::string* payload) {
+  uint8 status = kLatticeServerError;
+  KALDI_ASSERT(ReadFully(fd, &status, 1) && ReadFrame(fd, payload));
+  return static_cast<LatticeServerStatus>(status);
+}
+
+// The lattices sent to ServeLatticeConnection() through a socket must reach
+// the handler unchanged, and the lattices returned by the handler must reach
+// the client unchanged. Invalid lattices and the errors of the handler are
+// reported to the client, and the connection goes on.
+void UnitTestServeLatticeConnection() {
+  int fds[2];
+  KALDI_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  std::vector<Lattice> lats(RandInt(1, 5));
+  for (size_t i = 0; i < lats.size(); ++i) {
+    RandomLattice(&lats[i]);
+    std::ostringstream key;
+    key << "lat-" << i;
+    SendRequest(fds[0], key.str(), SerializeLattice(lats[i]));
+  }
+  SendRequest(fds[0], "invalid", "not a lattice");
+  SendRequest(fds[0], "failed", SerializeLattice(lats[0]));
+  // The requests are small enough for the buffers of the socket, so they are
+  // all sent before serving them in this thread.
+  KALDI_ASSERT(shutdown(fds[0], SHUT_WR) == 0);
+  size_t num_received = 0;
+  const size_t num_served = ServeLatticeConnection(
+      fds[1], [&](const std::string& key, Lattice* inp, Lattice* out,
+                  std::string* error) -> LatticeServerStatus {
+        if (key == "failed") {
+          *error = "handler failed";
+          return kLatticeServerError;
+        }
+        KALDI_ASSERT(LatticesEqual(*inp, lats[num_received++]));
+        *out = *inp;
+        fst::Invert(out);
+        return kLatticeServerOk;
+      });
+  close(fds[1]);
+  KALDI_ASSERT(num_served == lats.size() + 2);
+  KALDI_ASSERT(num_received == lats.size());
+  std::string payload;
+  for (size_t i = 0; i < lats.size(); ++i) {
+    KALDI_ASSERT(ReadResponse(fds[0], &payload) == kLatticeServerOk);
+    Lattice out, expected(lats[i]);
+    fst::Invert(&expected);
+    KALDI_ASSERT(DeserializeLattice(payload, &out));
+    KALDI_ASSERT(LatticesEqual(out, expected));
+  }
+  KALDI_ASSERT(ReadResponse(fds[0], &payload) == kLatticeServerError);
+  KALDI_ASSERT(payload == "Could not read lattice invalid");
+  KALDI_ASSERT(ReadResponse(fds[0], &payload) == kLatticeServerError);
+  KALDI_ASSERT(payload == "handler failed");
+  char c;
+  KALDI_ASSERT(read(fds[0], &c, 1) == 0);
+  close(fds[0]);
+}
+
+}  // namespace kaldi
+
+int main() {
+  using namespace kaldi;
+  for (int i = 0; i < 20; ++i) UnitTestServeLatticeConnection();
+  std::cout << "Test OK.\n";
+  return 0;
+}
@@ -0,0 +1,293 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef LATTICE_SERVER_H_
+#define LATTICE_SERVER_H_
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include "lat/kaldi-lattice.h"
+#include "mapped-file.h"
+
+// Simple protocol to process lattices in a long-running server, over a Unix
+// domain socket. Each connection carries any number of requests, answered in
+// order:
+//
+//   request  = <uint32 key length> <key> <uint64 lattice length> <lattice>
+//   response = <uint8 status> <uint64 payload length> <payload>
+//
+// Lattices are serialized in Kaldi binary format (as in archives). If the
+// status is kLatticeServerOk the payload is the output lattice, otherwise it
+// is an error message. Integers are in host byte order.
+
+namespace kaldi {
+
+enum LatticeServerStatus {
+  kLatticeServerOk = 0,
+  kLatticeServerSkipped = 1,
+  kLatticeServerError = 2
+};
+
+// Maximum length of a key, to detect corrupted requests early.
+static const uint32 kLatticeServerMaxKeyLength = 1 << 16;
+
+// Maximum length of a serialized lattice, so that a corrupted length does not
+// make the server allocate an arbitrary amount of memory.
+static const uint64 kLatticeServerMaxPayloadSize = static_cast<uint64>(1) << 32;
+
+// Read exactly n bytes from fd. Returns false on EOF or error.
+inline bool ReadFully(int fd, void* buf, size_t n) {
+  char* p = static_cast<char*>(buf);
+  while (n > 0) {
+    const ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+// Write exactly n bytes to fd. Returns false on error.
+inline bool WriteFully(int fd, const void* buf, size_t n) {
+  const char* p = static_cast<const char*>(buf);
+  while (n > 0) {
+    const ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    p += w;
+    n -= w;
+  }
+  return true;
+}
+
+inline std::string SerializeLattice(const Lattice& lat) {
+  std::ostringstream os;
+  if (!LatticeHolder::Write(os, true, lat)) {
+    KALDI_ERR << "Could not serialize lattice";
+  }
+  return os.str();
+}
+
+// Read a lattice written by SerializeLattice(). As in archives, binary
+// lattices have no binary header (they start with the FST magic number), so
+// they are read with LatticeHolder::Read(), which detects their format.
+inline bool DeserializeLattice(const std::string& data, Lattice* lat) {
+  MemoryStreamBuf buf(data.data(), data.data() + data.size());
+  std::istream is(&buf);
+  LatticeHolder holder;
+  if (!holder.Read(is)) return false;
+  *lat = holder.Value();
+  return true;
+}
+
+inline bool WriteFrame(int fd, const std::string& data) {
+  const uint64 size = data.size();
+  return WriteFully(fd, &size, sizeof(size)) &&
+      WriteFully(fd, data.data(), data.size());
+}
+
+// Read a frame written by WriteFrame(). Returns false on EOF or error, or if
+// the frame is longer than kLatticeServerMaxPayloadSize or does not fit in
+// memory.
+inline bool ReadFrame(int fd, std::string* data) {
+  uint64 size = 0;
+  if (!ReadFully(fd, &size, sizeof(size))) return false;
+  if (size > kLatticeServerMaxPayloadSize) {
+    KALDI_WARN << "Frame of " << size << " bytes exceeds the maximum of "
+               << kLatticeServerMaxPayloadSize << " bytes";
+    return false;
+  }
+  try {
+    data->resize(size);
+  } catch (const std::exception& e) {
+    KALDI_WARN << "Could not allocate a frame of " << size << " bytes: "
+               << e.what();
+    return false;
+  }
+  return size == 0 || ReadFully(fd, &(*data)[0], size);
+}
+
+inline sockaddr_un LatticeServerAddress(const std::string& path) {
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    KALDI_ERR << "Socket path is too long: " << path;
+  }
+  std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return addr;
+}
+
+// Function called by the server for each request. It must process the input
+// lattice (which can be modified) and return the status of the request.
+// On failure, the output lattice is ignored and the error message is sent to
+// the client.
+typedef std::function<LatticeServerStatus(
+    const std::string& key, Lattice* inp, Lattice* out,
+    std::string* error)> LatticeServerHandler;
+
+// Serve the requests of a connection until it is closed or a request is
+// invalid. Returns the number of requests served.
+inline size_t ServeLatticeConnection(int fd,
+                                     const LatticeServerHandler& handler) {
+  size_t num_requests = 0;
+  std::string key, data;
+  uint32 key_length = 0;
+  while (ReadFully(fd, &key_length, sizeof(key_length))) {
+    if (key_length > kLatticeServerMaxKeyLength) {
+      KALDI_WARN << "Invalid request (key length " << key_length
+                 << "), closing connection";
+      break;
+    }
+    key.resize(key_length);
+    if ((key_length > 0 && !ReadFully(fd, &key[0], key_length)) ||
+        !ReadFrame(fd, &data)) {
+      KALDI_WARN << "Invalid or incomplete request, closing connection";
+      break;
+    }
+    Lattice inp, out;
+    std::string error, payload;
+    LatticeServerStatus status = kLatticeServerError;
+    try {
+      if (!DeserializeLattice(data, &inp)) {
+        error = "Could not read lattice " + key;
+      } else {
+        status = handler(key, &inp, &out, &error);
+      }
+      if (status == kLatticeServerOk) payload = SerializeLattice(out);
+    } catch (const std::exception& e) {
+      status = kLatticeServerError;
+      error = e.what();
+    }
+    if (status != kLatticeServerOk) payload = error;
+    const uint8 status_byte = status;
+    if (!WriteFully(fd, &status_byte, 1) || !WriteFrame(fd, payload)) {
+      KALDI_WARN << "Could not send response, closing connection";
+      break;
+    }
+    ++num_requests;
+    KALDI_VLOG(1) << "Served lattice " << key;
+  }
+  return num_requests;
+}
+
+// Serve requests on the Unix domain socket at the given path, one connection
+// at a time, until the process is killed. Any existing file at path is
+// replaced. Invalid requests only close their own connection.
+inline void RunLatticeServer(const std::string& path,
+                             const LatticeServerHandler& handler) {
+  // Clients that disconnect must not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+  const sockaddr_un addr = LatticeServerAddress(path);
+  const int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server_fd < 0) {
+    KALDI_ERR << "Could not create socket: " << strerror(errno);
+  }
+  unlink(path.c_str());
+  if (bind(server_fd, reinterpret_cast<const sockaddr*>(&addr),
+           sizeof(addr)) != 0 || listen(server_fd, 16) != 0) {
+    close(server_fd);
+    KALDI_ERR << "Could not listen on socket " << path << ": "
+              << strerror(errno);
+  }
+  KALDI_LOG << "Listening on " << path;
+  size_t num_requests = 0;
+  while (true) {
+    const int fd = accept(server_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      close(server_fd);
+      KALDI_ERR << "Could not accept connection: " << strerror(errno);
+    }
+    try {
+      num_requests += ServeLatticeConnection(fd, handler);
+    } catch (const std::exception& e) {
+      KALDI_WARN << "Error serving connection, closing it: " << e.what();
+    }
+    close(fd);
+    KALDI_VLOG(1) << "Connection closed (" << num_requests
+                  << " requests served so far)";
+  }
+}
+
+// Client of a lattice server, used for testing and for batch processing
+// through a running server.
+class LatticeServerClient {
+ public:
+  explicit LatticeServerClient(const std::string& path) {
+    const sockaddr_un addr = LatticeServerAddress(path);
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ < 0 ||
+        connect(fd_, reinterpret_cast<const sockaddr*>(&addr),
+                sizeof(addr)) != 0) {
+      KALDI_ERR << "Could not connect to " << path << ": " << strerror(errno);
+    }
+  }
+
+  ~LatticeServerClient() { close(fd_); }
+
+  // Send the lattice to the server and wait for the response. On failure,
+  // error contains the message from the server.
+  LatticeServerStatus Process(const std::string& key, const Lattice& inp,
+                              Lattice* out, std::string* error) {
+    const uint32 key_length = key.size();
+    std::string payload = SerializeLattice(inp);
+    uint8 status = kLatticeServerError;
+    if (!WriteFully(fd_, &key_length, sizeof(key_length)) ||
+        !WriteFully(fd_, key.data(), key.size()) ||
+        !WriteFrame(fd_, payload) || !ReadFully(fd_, &status, 1) ||
+        !ReadFrame(fd_, &payload)) {
+      KALDI_ERR << "Connection to the lattice server lost";
+    }
+    if (status == kLatticeServerOk) {
+      if (!DeserializeLattice(payload, out)) {
+        KALDI_ERR << "Invalid lattice received from the server";
+      }
+    } else {
+      *error = payload;
+    }
+    return static_cast<LatticeServerStatus>(status);
+  }
+
+ private:
+  int fd_;
+
+  LatticeServerClient(const LatticeServerClient&);
+  LatticeServerClient& operator=(const LatticeServerClient&);
+};
+
+}  // namespace kaldi
+
+#endif  // LATTICE_SERVER_H_
@@ -0,0 +1,241 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PARALLEL_CTC_BLANK_COLLAPSER_H_
+#define PARALLEL_CTC_BLANK_COLLAPSER_H_
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "lat/kaldi-lattice.h"
+#include "ctc-blank-collapser.h"
+#include "soa-lattice.h"
+
+namespace kaldi {
+
+// Call f(t) for t = 0, ..., num_threads - 1, each in a different thread.
+inline void RunThreads(int32 num_threads,
+                       const std::function<void(int32)>& f) {
+  std::vector<std::thread> threads;
+  for (int32 t = 1; t < num_threads; ++t) threads.push_back(std::thread(f, t));
+  f(0);
+  for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+}
+
+// Computes the same lattice as CtcBlankCollapser (state by state identical),
+// using several threads for very large lattices.
+//
+// The topologically sorted input is partitioned into slices of consecutive
+// states. Since the output states paired with each input state s are simply
+// the labels of the arcs entering s, they can be found independently:
+//  1. Each thread sends the pairs (n, q) produced by the arcs leaving its
+//     slice to the slice of n.
+//  2. Each thread sorts the pairs received by its slice. Their position in
+//     the sorted list, plus the number of pairs in the previous slices,
+//     gives the output state ids (the order of CtcBlankCollapser).
+//  3. Each thread builds the arcs leaving the output states of its slice,
+//     looking up the states in the next slices at the boundary.
+// Finally, the arcs are copied into the output lattice (VectorFst can not be
+// modified concurrently).
+//
+// The states paired with the target of an epsilon arc depend on the source
+// state, and so does the accessibility of the states, which would make the
+// slices depend on each other. Lattices with epsilon arcs or inaccessible
+// states (not the case after pruning) are left to the sequential collapser.
+class ParallelCtcBlankCollapser {
+ public:
+  typedef LatticeArc::StateId StateId;
+  typedef LatticeArc::Label Label;
+
+  ParallelCtcBlankCollapser(const CtcBlankSet& blanks, int32 num_threads,
+                            CtcArcSort sort = kCtcArcSortNone)
+      : blanks_(blanks), num_threads_(std::max(num_threads, 1)),
+        sort_(sort) {}
+
+  // Collapse the topologically sorted lattice inp into out. Returns false
+  // (without modifying out) if the input has epsilon arcs or inaccessible
+  // states with arcs; the sequential collapser must be used then.
+  bool Collapse(const SoaLattice& inp, Lattice* out) {
+    const StateId num_states = inp.NumStates();
+    const int32 num_slices = num_threads_;
+    slice_begin_.resize(num_slices + 1);
+    for (int32 t = 0; t <= num_slices; ++t)
+      slice_begin_[t] = static_cast<StateId>(
+          static_cast<int64>(num_states) * t / num_slices);
+    sent_.assign(num_slices, std::vector<std::vector<Pair> >(num_slices));
+    pairs_.assign(num_slices, std::vector<Pair>());
+    pair_begin_.assign(num_slices, std::vector<size_t>());
+    arcs_.assign(num_slices, std::vector<LatticeArc>());
+    arc_begin_.assign(num_slices, std::vector<size_t>());
+    std::vector<char> has_epsilons(num_slices, 0);
+    // 1. Send the pairs to the slices of their input states.
+    RunThreads(num_threads_, [&](int32 t) {
+        std::vector<std::vector<Pair> >& sent = sent_[t];
+        for (StateId s = slice_begin_[t]; s < slice_begin_[t + 1]; ++s) {
+          if (s == inp.Start()) sent[t].push_back(Pair(s, 0));
+          for (size_t a = inp.ArcBegin(s); a < inp.ArcEnd(s); ++a) {
+            const StateId n = inp.NextState(a);
+            const Label olabel = inp.OLabel(a);
+            KALDI_ASSERT(n > s && "Input lattice is not topologically sorted");
+            if (olabel == 0) {
+              has_epsilons[t] = 1;
+              return;
+            }
+            sent[SliceOf(n)].push_back(Pair(n, CState(olabel)));
+          }
+        }
+      });
+    for (int32 t = 0; t < num_slices; ++t)
+      if (has_epsilons[t]) return false;
+    // 2. Sort the pairs of each slice.
+    std::vector<char> has_inaccessible(num_slices, 0);
+    RunThreads(num_threads_, [&](int32 t) {
+        std::vector<Pair>& pairs = pairs_[t];
+        for (int32 u = 0; u <= t; ++u) {
+          pairs.insert(pairs.end(), sent_[u][t].begin(), sent_[u][t].end());
+          std::vector<Pair>().swap(sent_[u][t]);
+        }
+        std::sort(pairs.begin(), pairs.end());
+        pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+        const StateId b = slice_begin_[t], e = slice_begin_[t + 1];
+        std::vector<size_t>& pair_begin = pair_begin_[t];
+        pair_begin.assign(e - b + 1, 0);
+        for (size_t i = 0; i < pairs.size(); ++i)
+          ++pair_begin[pairs[i].first - b + 1];
+        for (StateId s = b; s < e; ++s) {
+          pair_begin[s - b + 1] += pair_begin[s - b];
+          // A state without pairs is inaccessible. If it has arcs, the pairs
+          // it sent in step 1 must not produce any output state, which
+          // requires propagating the accessibility in order.
+          if (pair_begin[s - b + 1] == pair_begin[s - b] &&
+              inp.NumArcs(s) > 0)
+            has_inaccessible[t] = 1;
+        }
+      });
+    for (int32 t = 0; t < num_slices; ++t)
+      if (has_inaccessible[t]) return false;
+    slice_offset_.assign(num_slices + 1, 0);
+    for (int32 t = 0; t < num_slices; ++t)
+      slice_offset_[t + 1] = slice_offset_[t] + pairs_[t].size();
+    // 3. Build the arcs of the output states of each slice.
+    RunThreads(num_threads_, [&](int32 t) {
+        const StateId b = slice_begin_[t];
+        const std::vector<Pair>& pairs = pairs_[t];
+        const std::vector<size_t>& pair_begin = pair_begin_[t];
+        std::vector<LatticeArc>& arcs = arcs_[t];
+        std::vector<size_t>& arc_begin = arc_begin_[t];
+        arc_begin.assign(pairs.size() + 1, 0);
+        std::vector<StateId> targets;
+        for (StateId s = b; s < slice_begin_[t + 1]; ++s) {
+          const size_t pb = pair_begin[s - b], pe = pair_begin[s - b + 1];
+          if (pb == pe) continue;
+          const size_t begin = inp.ArcBegin(s), end = inp.ArcEnd(s);
+          targets.clear();
+          for (size_t a = begin; a < end; ++a) {
+            const Label olabel = inp.OLabel(a);
+            targets.push_back(OutputState(inp.NextState(a), CState(olabel)));
+          }
+          for (size_t k = pb; k < pe; ++k) {
+            const Label q = pairs[k].second;
+            for (size_t a = begin; a < end; ++a) {
+              const Label olabel = inp.OLabel(a), c = CState(olabel);
+              arcs.push_back(LatticeArc(
+                  inp.ILabel(a), (c == 0 || c == q) ? 0 : olabel,
+                  inp.Weight(a), targets[a - begin]));
+            }
+            SortCtcArcs(sort_, arcs.begin() + arc_begin[k], arcs.end());
+            arc_begin[k + 1] = arcs.size();
+          }
+        }
+        for (size_t k = 0; k < pairs.size(); ++k)
+          arc_begin[k + 1] = std::max(arc_begin[k + 1], arc_begin[k]);
+      });
+    // 4. Copy the output states and arcs.
+    out->DeleteStates();
+    out->ReserveStates(slice_offset_[num_slices]);
+    for (int32 t = 0; t < num_slices; ++t) {
+      const std::vector<Pair>& pairs = pairs_[t];
+      const std::vector<LatticeArc>& arcs = arcs_[t];
+      const std::vector<size_t>& arc_begin = arc_begin_[t];
+      for (size_t k = 0; k < pairs.size(); ++k) {
+        const StateId o = out->AddState();
+        out->SetFinal(o, inp.Final(pairs[k].first));
+        out->ReserveArcs(o, arc_begin[k + 1] - arc_begin[k]);
+        for (size_t a = arc_begin[k]; a < arc_begin[k + 1]; ++a)
+          out->AddArc(o, arcs[a]);
+      }
+      std::vector<LatticeArc>().swap(arcs_[t]);
+    }
+    if (inp.Start() != fst::kNoStateId)
+      out->SetStart(OutputState(inp.Start(), 0));
+    return true;
+  }
+
+ private:
+  typedef std::pair<StateId, Label> Pair;
+
+  int32 SliceOf(StateId s) const {
+    return std::upper_bound(slice_begin_.begin(), slice_begin_.end(), s) -
+        slice_begin_.begin() - 1;
+  }
+
+  // State of C reached by an arc with the given (non-epsilon) label.
+  Label CState(Label olabel) const {
+    return blanks_.IsBlank(olabel) ? 0 : olabel;
+  }
+
+  // Output state of the pair (n, q), which must exist.
+  StateId OutputState(StateId n, Label q) const {
+    const int32 t = SliceOf(n);
+    const std::vector<Pair>& pairs = pairs_[t];
+    const std::vector<size_t>& pair_begin = pair_begin_[t];
+    const size_t i = std::lower_bound(
+        pairs.begin() + pair_begin[n - slice_begin_[t]],
+        pairs.begin() + pair_begin[n - slice_begin_[t] + 1],
+        Pair(n, q)) - pairs.begin();
+    return slice_offset_[t] + i;
+  }
+
+  const CtcBlankSet blanks_;
+  const int32 num_threads_;
+  const CtcArcSort sort_;
+  // First input state of each slice.
+  std::vector<StateId> slice_begin_;
+  // Pairs sent by each slice (first index) to each slice (second index).
+  std::vector<std::vector<std::vector<Pair> > > sent_;
+  // Sorted pairs of each slice, and the first pair of each input state.
+  std::vector<std::vector<Pair> > pairs_;
+  std::vector<std::vector<size_t> > pair_begin_;
+  // Output state id of the first pair of each slice.
+  std::vector<StateId> slice_offset_;
+  // Arcs leaving the output states of each slice.
+  std::vector<std::vector<LatticeArc> > arcs_;
+  std::vector<std::vector<size_t> > arc_begin_;
+};
+
+}  // namespace kaldi
+
+#endif  // PARALLEL_CTC_BLANK_COLLAPSER_H_
@@ -0,0 +1,110 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "base/kaldi-common.h"
+#include "base/kaldi-math.h"
+#include "lat/kaldi-lattice.h"
+#include "lat/lattice-functions.h"
+#include "parallel-lattice-prune.h"
+
+namespace kaldi {
+
+typedef LatticeArc::StateId StateId;
+
+static bool LatticesEqual(const Lattice& a, const Lattice& b) {
+  if (a.NumStates() != b.NumStates() || a.Start() != b.Start()) return false;
+  for (StateId s = 0; s < a.NumStates(); ++s) {
+    if (a.Final(s) != b.Final(s) || a.NumArcs(s) != b.NumArcs(s))
+      return false;
+    fst::ArcIterator<Lattice> aiter(a, s), biter(b, s);
+    for (; !aiter.Done(); aiter.Next(), biter.Next()) {
+      const LatticeArc& x = aiter.Value(), &y = biter.Value();
+      if (x.ilabel != y.ilabel || x.olabel != y.olabel ||
+          x.nextstate != y.nextstate || x.weight != y.weight)
+        return false;
+    }
+  }
+  return true;
+}
+
+// Weights are multiples of 0.25, so that the costs are summed exactly in any
+// order and ties with the cutoff are broken in the same way by both pruners.
+static LatticeWeight RandomWeight() {
+  return LatticeWeight(RandInt(0, 10) * 0.5, RandInt(0, 10) * 0.25);
+}
+
+// Random lattice layered by frame, as produced by a decoder: the states of
+// each frame are numbered after those of the previous one, and all the arcs
+// go to the next frame. Some states of the last frame are not final.
+static void RandomLayeredLattice(Lattice* lat) {
+  lat->DeleteStates();
+  std::vector<StateId> prev(1, lat->AddState()), next;
+  lat->SetStart(prev[0]);
+  const int32 num_frames = RandInt(1, 10);
+  for (int32 t = 0; t < num_frames; ++t) {
+    next.clear();
+    const int32 num_states = RandInt(1, 4);
+    for (int32 i = 0; i < num_states; ++i) next.push_back(lat->AddState());
+    for (size_t i = 0; i < std::max(prev.size(), next.size()); ++i) {
+      lat->AddArc(prev[i % prev.size()],
+                  LatticeArc(RandInt(1, 5), RandInt(0, 5), RandomWeight(),
+                             next[i % next.size()]));
+    }
+    for (size_t i = 0; i < prev.size(); ++i) {
+      const int32 num_arcs = RandInt(0, 3);
+      for (int32 a = 0; a < num_arcs; ++a) {
+        lat->AddArc(prev[i], LatticeArc(RandInt(1, 5), RandInt(0, 5),
+                                        RandomWeight(),
+                                        next[RandInt(0, num_states - 1)]));
+      }
+    }
+    prev.swap(next);
+  }
+  for (size_t i = 0; i < prev.size(); ++i)
+    if (i == 0 || RandInt(0, 2) != 0) lat->SetFinal(prev[i], RandomWeight());
+}
+
+// ParallelLatticePruner must keep the same arcs and final weights as
+// PruneLattice(), for any number of threads.
+void UnitTestParallelLatticePruner() {
+  Lattice lat;
+  RandomLayeredLattice(&lat);
+  const BaseFloat beam = RandInt(1, 20) * 0.5;
+  Lattice expected(lat);
+  const bool expected_ok = PruneLattice(beam, &expected);
+  for (int32 num_threads = 1; num_threads <= 4; ++num_threads) {
+    Lattice pruned(lat);
+    ParallelLatticePruner pruner(num_threads);
+    KALDI_ASSERT(pruner.Prune(beam, &pruned) == expected_ok);
+    KALDI_ASSERT(LatticesEqual(pruned, expected));
+  }
+}
+
+}  // namespace kaldi
+
+int main() {
+  using namespace kaldi;
+  for (int i = 0; i < 100; ++i) UnitTestParallelLatticePruner();
+  std::cout << "Test OK.\n";
+  return 0;
+}
@@ -0,0 +1,252 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PARALLEL_LATTICE_PRUNE_H_
+#define PARALLEL_LATTICE_PRUNE_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "fstext/fstext-utils.h"
+#include "lat/kaldi-lattice.h"
+
+namespace kaldi {
+
+// Reusable barrier for a fixed number of threads.
+class ThreadBarrier {
+ public:
+  explicit ThreadBarrier(int32 num_threads)
+      : num_threads_(num_threads), num_waiting_(0), generation_(0) {}
+
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const size_t generation = generation_;
+    if (++num_waiting_ == num_threads_) {
+      num_waiting_ = 0;
+      ++generation_;
+      cond_.notify_all();
+    } else {
+      cond_.wait(lock, [&] { return generation_ != generation; });
+    }
+  }
+
+ private:
+  const int32 num_threads_;
+  int32 num_waiting_;
+  size_t generation_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
+
+// Same result as PruneLattice(), but the forward and backward scores are
+// computed with several threads.
+//
+// The states are grouped in levels (the length of the longest path from the
+// start state), so that there are no arcs among the states of the same
+// level. For lattices layered by frame, these are the states of each frame.
+// The threads process the states of each level in parallel (the forward pass
+// pulls from the incoming arcs, so there are no concurrent writes), and
+// synchronize between levels. The arcs are copied into contiguous arrays
+// first, so that the passes do not touch the lattice.
+//
+// Returns false if the lattice has no successful path (as PruneLattice()).
+class ParallelLatticePruner {
+ public:
+  typedef LatticeArc::StateId StateId;
+
+  explicit ParallelLatticePruner(int32 num_threads)
+      : num_threads_(std::max(num_threads, 1)) {}
+
+  bool Prune(BaseFloat beam, Lattice* lat) {
+    KALDI_ASSERT(beam > 0.0);
+    if (lat->Properties(fst::kTopSorted, true) != fst::kTopSorted &&
+        !fst::TopSort(lat)) {
+      KALDI_ERR << "Cycles detected in lattice";
+    }
+    if (lat->Start() == fst::kNoStateId) return false;
+    Init(*lat);
+    std::vector<std::thread> threads;
+    ThreadBarrier barrier(num_threads_);
+    for (int32 t = 1; t < num_threads_; ++t) {
+      threads.push_back(std::thread(&ParallelLatticePruner::Run, this, t,
+                                    &barrier));
+    }
+    Run(0, &barrier);
+    for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+    const double best = beta_[lat->Start()];
+    if (best == std::numeric_limits<double>::infinity()) {
+      lat->DeleteStates();
+      return false;
+    }
+    const double cutoff = best + beam;
+    // Remove the arcs and final weights out of the beam.
+    std::vector<LatticeArc> arcs;
+    for (StateId s = 0; s < num_states_; ++s) {
+      const double alpha = alpha_[s];
+      if (alpha + beta_[s] > cutoff) {
+        lat->DeleteArcs(s);
+        lat->SetFinal(s, LatticeWeight::Zero());
+        continue;
+      }
+      if (alpha + final_cost_[s] > cutoff)
+        lat->SetFinal(s, LatticeWeight::Zero());
+      arcs.clear();
+      size_t a = out_begin_[s];
+      for (fst::ArcIterator<Lattice> aiter(*lat, s); !aiter.Done();
+           aiter.Next(), ++a) {
+        if (alpha + out_cost_[a] + beta_[out_dest_[a]] <= cutoff)
+          arcs.push_back(aiter.Value());
+      }
+      if (arcs.size() != lat->NumArcs(s)) {
+        lat->DeleteArcs(s);
+        for (size_t k = 0; k < arcs.size(); ++k) lat->AddArc(s, arcs[k]);
+      }
+    }
+    fst::Connect(lat);
+    return lat->Start() != fst::kNoStateId;
+  }
+
+ private:
+  static double Cost(const LatticeWeight& w) {
+    return static_cast<double>(w.Value1()) + static_cast<double>(w.Value2());
+  }
+
+  // Copy the arcs into the outgoing and incoming arrays and group the states
+  // by level.
+  void Init(const Lattice& lat) {
+    const double inf = std::numeric_limits<double>::infinity();
+    num_states_ = lat.NumStates();
+    start_ = lat.Start();
+    out_begin_.assign(num_states_ + 1, 0);
+    in_begin_.assign(num_states_ + 1, 0);
+    final_cost_.resize(num_states_);
+    std::vector<int32> level(num_states_, 0);
+    int32 num_levels = 1;
+    for (StateId s = 0; s < num_states_; ++s) {
+      final_cost_[s] = Cost(lat.Final(s));
+      out_begin_[s + 1] = out_begin_[s] + lat.NumArcs(s);
+      for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+           aiter.Next()) {
+        const StateId n = aiter.Value().nextstate;
+        level[n] = std::max(level[n], level[s] + 1);
+        num_levels = std::max(num_levels, level[n] + 1);
+        ++in_begin_[n + 1];
+      }
+    }
+    for (StateId s = 0; s < num_states_; ++s)
+      in_begin_[s + 1] += in_begin_[s];
+    const size_t num_arcs = out_begin_[num_states_];
+    out_dest_.resize(num_arcs);
+    out_cost_.resize(num_arcs);
+    in_source_.resize(num_arcs);
+    in_cost_.resize(num_arcs);
+    std::vector<size_t> in_pos(in_begin_.begin(), in_begin_.end() - 1);
+    size_t a = 0;
+    for (StateId s = 0; s < num_states_; ++s) {
+      for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+           aiter.Next(), ++a) {
+        const LatticeArc& arc = aiter.Value();
+        const double c = Cost(arc.weight);
+        out_dest_[a] = arc.nextstate;
+        out_cost_[a] = c;
+        const size_t i = in_pos[arc.nextstate]++;
+        in_source_[i] = s;
+        in_cost_[i] = c;
+      }
+    }
+    // Counting sort of the states by level.
+    level_begin_.assign(num_levels + 1, 0);
+    for (StateId s = 0; s < num_states_; ++s) ++level_begin_[level[s] + 1];
+    for (int32 l = 0; l < num_levels; ++l)
+      level_begin_[l + 1] += level_begin_[l];
+    std::vector<size_t> level_pos(level_begin_.begin(),
+                                  level_begin_.end() - 1);
+    level_states_.resize(num_states_);
+    for (StateId s = 0; s < num_states_; ++s)
+      level_states_[level_pos[level[s]]++] = s;
+    alpha_.assign(num_states_, inf);
+    beta_.assign(num_states_, inf);
+  }
+
+  // States of the given level processed by thread t.
+  void LevelRange(int32 l, int32 t, size_t* begin, size_t* end) const {
+    const size_t b = level_begin_[l], n = level_begin_[l + 1] - b;
+    *begin = b + n * t / num_threads_;
+    *end = b + n * (t + 1) / num_threads_;
+  }
+
+  void Run(int32 t, ThreadBarrier* barrier) {
+    const int32 num_levels = level_begin_.size() - 1;
+    size_t begin, end;
+    for (int32 l = 0; l < num_levels; ++l) {
+      LevelRange(l, t, &begin, &end);
+      for (size_t i = begin; i < end; ++i) {
+        const StateId s = level_states_[i];
+        double alpha = (s == start_ ? 0.0 :
+                        std::numeric_limits<double>::infinity());
+        for (size_t a = in_begin_[s]; a < in_begin_[s + 1]; ++a)
+          alpha = std::min(alpha, alpha_[in_source_[a]] + in_cost_[a]);
+        alpha_[s] = alpha;
+      }
+      barrier->Wait();
+    }
+    for (int32 l = num_levels - 1; l >= 0; --l) {
+      LevelRange(l, t, &begin, &end);
+      for (size_t i = begin; i < end; ++i) {
+        const StateId s = level_states_[i];
+        double beta = final_cost_[s];
+        for (size_t a = out_begin_[s]; a < out_begin_[s + 1]; ++a)
+          beta = std::min(beta, out_cost_[a] + beta_[out_dest_[a]]);
+        beta_[s] = beta;
+      }
+      barrier->Wait();
+    }
+  }
+
+  const int32 num_threads_;
+  StateId num_states_;
+  StateId start_;
+  // Arcs leaving each state, in the order of the lattice.
+  std::vector<size_t> out_begin_;
+  std::vector<StateId> out_dest_;
+  std::vector<double> out_cost_;
+  // Arcs entering each state.
+  std::vector<size_t> in_begin_;
+  std::vector<StateId> in_source_;
+  std::vector<double> in_cost_;
+  std::vector<double> final_cost_;
+  // States sorted by level, and the first state of each level.
+  std::vector<StateId> level_states_;
+  std::vector<size_t> level_begin_;
+  // Forward and backward costs.
+  std::vector<double> alpha_;
+  std::vector<double> beta_;
+};
+
+}  // namespace kaldi
+
+#endif  // PARALLEL_LATTICE_PRUNE_H_
@@ -0,0 +1,237 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef SIMD_KERNELS_H_
+#define SIMD_KERNELS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+// Vectorized reductions over contiguous arrays of costs (negated
+// log-probabilities), used by the forward-backward passes over the frames of
+// grid lattices (see grid-lattice.h).
+//
+// The AVX-512 or AVX2 versions are used when the compiler targets them (e.g.
+// with -march=native, see SIMD_FLAGS in the Makefile); otherwise, and for
+// the tails of the arrays, the scalar versions are used.
+
+namespace kaldi {
+
+namespace simd_internal {
+
+// Costs larger than this (relative to the shift) underflow the exponential.
+static const float kMaxExpCost = 87.0f;
+
+// Coefficients of the polynomial approximation of exp(r), r in
+// [-ln(2)/2, ln(2)/2] (as in Cephes' expf), and ln(2) split in two parts.
+static const float kExpP0 = 1.9875691500e-4f;
+static const float kExpP1 = 1.3981999507e-3f;
+static const float kExpP2 = 8.3334519073e-3f;
+static const float kExpP3 = 4.1665795894e-2f;
+static const float kExpP4 = 1.6666665459e-1f;
+static const float kExpP5 = 5.0000001201e-1f;
+static const float kLn2Hi = 0.693359375f;
+static const float kLn2Lo = -2.12194440e-4f;
+static const float kLog2e = 1.44269504088896341f;
+
+#if defined(__AVX512F__)
+// exp(x) for x in [-kMaxExpCost, 0], and 0 for smaller x (or NaN).
+inline __m512 Exp(__m512 x) {
+  const __mmask16 valid = _mm512_cmp_ps_mask(
+      x, _mm512_set1_ps(-kMaxExpCost), _CMP_GE_OQ);
+  x = _mm512_max_ps(x, _mm512_set1_ps(-kMaxExpCost));
+  const __m512 n = _mm512_roundscale_ps(
+      _mm512_fmadd_ps(x, _mm512_set1_ps(kLog2e), _mm512_set1_ps(0.5f)),
+      _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  x = _mm512_fnmadd_ps(n, _mm512_set1_ps(kLn2Hi), x);
+  x = _mm512_fnmadd_ps(n, _mm512_set1_ps(kLn2Lo), x);
+  __m512 y = _mm512_set1_ps(kExpP0);
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(kExpP1));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(kExpP2));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(kExpP3));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(kExpP4));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(kExpP5));
+  y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x),
+                      _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+  // Multiply by 2^n, building the exponent bits.
+  const __m512i e = _mm512_slli_epi32(
+      _mm512_add_epi32(_mm512_cvttps_epi32(n), _mm512_set1_epi32(127)), 23);
+  y = _mm512_mul_ps(y, _mm512_castsi512_ps(e));
+  return _mm512_maskz_mov_ps(valid, y);
+}
+#elif defined(__AVX2__)
+inline __m256 MulAdd(__m256 a, __m256 b, __m256 c) {
+#if defined(__FMA__)
+  return _mm256_fmadd_ps(a, b, c);
+#else
+  return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+// exp(x) for x in [-kMaxExpCost, 0], and 0 for smaller x (or NaN).
+inline __m256 Exp(__m256 x) {
+  const __m256 valid = _mm256_cmp_ps(x, _mm256_set1_ps(-kMaxExpCost),
+                                     _CMP_GE_OQ);
+  x = _mm256_max_ps(x, _mm256_set1_ps(-kMaxExpCost));
+  const __m256 n = _mm256_floor_ps(
+      MulAdd(x, _mm256_set1_ps(kLog2e), _mm256_set1_ps(0.5f)));
+  x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(kLn2Hi)));
+  x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(kLn2Lo)));
+  __m256 y = _mm256_set1_ps(kExpP0);
+  y = MulAdd(y, x, _mm256_set1_ps(kExpP1));
+  y = MulAdd(y, x, _mm256_set1_ps(kExpP2));
+  y = MulAdd(y, x, _mm256_set1_ps(kExpP3));
+  y = MulAdd(y, x, _mm256_set1_ps(kExpP4));
+  y = MulAdd(y, x, _mm256_set1_ps(kExpP5));
+  y = MulAdd(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+  // Multiply by 2^n, building the exponent bits.
+  const __m256i e = _mm256_slli_epi32(
+      _mm256_add_epi32(_mm256_cvttps_epi32(n), _mm256_set1_epi32(127)), 23);
+  y = _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+  return _mm256_and_ps(y, valid);
+}
+
+inline float HorizontalMin(__m256 v) {
+  __m128 m = _mm_min_ps(_mm256_castps256_ps128(v),
+                        _mm256_extractf128_ps(v, 1));
+  m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+  m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+  return _mm_cvtss_f32(m);
+}
+
+inline float HorizontalSum(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+                        _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+#endif
+
+// Scalar exp(x), with the same range as the vectorized versions.
+inline float Exp(float x) {
+  return x >= -kMaxExpCost ? std::exp(x) : 0.0f;
+}
+
+}  // namespace simd_internal
+
+// Minimum of x[0], ..., x[n - 1] (infinity if n == 0).
+inline float SimdMin(const float* x, size_t n) {
+  float m = std::numeric_limits<float>::infinity();
+  size_t i = 0;
+#if defined(__AVX512F__)
+  if (n >= 16) {
+    __m512 v = _mm512_loadu_ps(x);
+    for (i = 16; i + 16 <= n; i += 16)
+      v = _mm512_min_ps(v, _mm512_loadu_ps(x + i));
+    m = _mm512_reduce_min_ps(v);
+  }
+#elif defined(__AVX2__)
+  if (n >= 8) {
+    __m256 v = _mm256_loadu_ps(x);
+    for (i = 8; i + 8 <= n; i += 8)
+      v = _mm256_min_ps(v, _mm256_loadu_ps(x + i));
+    m = simd_internal::HorizontalMin(v);
+  }
+#endif
+  for (; i < n; ++i) m = std::min(m, x[i]);
+  return m;
+}
+
+// out[i] = a[i] + b[i], for i = 0, ..., n - 1. out may be a or b.
+inline void SimdAdd(const float* a, const float* b, size_t n, float* out) {
+  size_t i = 0;
+#if defined(__AVX512F__)
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(out + i, _mm512_add_ps(_mm512_loadu_ps(a + i),
+                                            _mm512_loadu_ps(b + i)));
+#elif defined(__AVX2__)
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(a + i),
+                                            _mm256_loadu_ps(b + i)));
+#endif
+  for (; i < n; ++i) out[i] = a[i] + b[i];
+}
+
+// out[i] = exp(shift - x[i]), for i = 0, ..., n - 1, which must not be
+// larger than 1 (i.e. shift <= x[i]); returns their sum. Costs more than
+// 87 nats above the shift (or infinite) give 0. out may be x, or NULL if only
+// the sum is needed.
+inline double SimdExpCosts(const float* x, size_t n, float shift,
+                           float* out) {
+  double sum = 0.0;
+  size_t i = 0;
+#if defined(__AVX512F__)
+  const __m512 s = _mm512_set1_ps(shift);
+  __m512 acc = _mm512_setzero_ps();
+  for (; i + 16 <= n; i += 16) {
+    const __m512 y =
+        simd_internal::Exp(_mm512_sub_ps(s, _mm512_loadu_ps(x + i)));
+    if (out != NULL) _mm512_storeu_ps(out + i, y);
+    acc = _mm512_add_ps(acc, y);
+  }
+  sum = _mm512_reduce_add_ps(acc);
+#elif defined(__AVX2__)
+  const __m256 s = _mm256_set1_ps(shift);
+  __m256 acc = _mm256_setzero_ps();
+  for (; i + 8 <= n; i += 8) {
+    const __m256 y =
+        simd_internal::Exp(_mm256_sub_ps(s, _mm256_loadu_ps(x + i)));
+    if (out != NULL) _mm256_storeu_ps(out + i, y);
+    acc = _mm256_add_ps(acc, y);
+  }
+  sum = simd_internal::HorizontalSum(acc);
+#endif
+  for (; i < n; ++i) {
+    const float y = simd_internal::Exp(shift - x[i]);
+    if (out != NULL) out[i] = y;
+    sum += y;
+  }
+  return sum;
+}
+
+// Log-sum of the costs x[0], ..., x[n - 1], i.e. -log(sum_i exp(-x[i]))
+// (infinity if all of them are infinite). If probs is not NULL, it receives
+// exp(-x[i]) relative to the largest one (see SimdExpCosts()), and *sum their
+// sum.
+inline double SimdLogSumCosts(const float* x, size_t n, float* probs = NULL,
+                              double* sum = NULL) {
+  const float m = SimdMin(x, n);
+  if (m == std::numeric_limits<float>::infinity()) {
+    if (probs != NULL) std::fill(probs, probs + n, 0.0f);
+    if (sum != NULL) *sum = 0.0;
+    return std::numeric_limits<double>::infinity();
+  }
+  const double s = SimdExpCosts(x, n, m, probs);
+  if (sum != NULL) *sum = s;
+  return m - std::log(s);
+}
+
+}  // namespace kaldi
+
+#endif  // SIMD_KERNELS_H_
@@ -0,0 +1,109 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "base/kaldi-common.h"
+#include "base/kaldi-math.h"
+#include "lat/kaldi-lattice.h"
+#include "soa-lattice.h"
+
+namespace kaldi {
+
+typedef LatticeArc::StateId StateId;
+
+static bool LatticesEqual(const Lattice& a, const Lattice& b) {
+  if (a.NumStates() != b.NumStates() || a.Start() != b.Start()) return false;
+  for (StateId s = 0; s < a.NumStates(); ++s) {
+    if (a.Final(s) != b.Final(s) || a.NumArcs(s) != b.NumArcs(s))
+      return false;
+    fst::ArcIterator<Lattice> aiter(a, s), biter(b, s);
+    for (; !aiter.Done(); aiter.Next(), biter.Next()) {
+      const LatticeArc& x = aiter.Value(), &y = biter.Value();
+      if (x.ilabel != y.ilabel || x.olabel != y.olabel ||
+          x.nextstate != y.nextstate || x.weight != y.weight)
+        return false;
+    }
+  }
+  return true;
+}
+
+// Random topologically sorted lattice, with arbitrary float weights, epsilon
+// labels, states without arcs and several final states.
+static void RandomLattice(Lattice* lat) {
+  lat->DeleteStates();
+  const StateId num_states = RandInt(1, 10);
+  for (StateId s = 0; s < num_states; ++s) lat->AddState();
+  lat->SetStart(0);
+  for (StateId s = 0; s + 1 < num_states; ++s) {
+    const int32 num_arcs = RandInt(0, 3);
+    for (int32 a = 0; a < num_arcs; ++a) {
+      lat->AddArc(s, LatticeArc(RandInt(0, 50), RandInt(0, 50),
+                                LatticeWeight(RandUniform() * 10,
+                                              RandUniform() * 10),
+                                RandInt(s + 1, num_states - 1)));
+    }
+    if (RandInt(0, 3) == 0)
+      lat->SetFinal(s, LatticeWeight(RandUniform(), RandUniform()));
+  }
+  lat->SetFinal(num_states - 1, LatticeWeight(RandUniform(), RandUniform()));
+}
+
+// Converting a lattice to a SoaLattice and back must give the same lattice,
+// whether the SoaLattice is built at once or appended state by state (as it
+// follows a lattice that is being extended), and also when it is reused.
+void UnitTestSoaLatticeRoundTrip() {
+  Lattice lat, out;
+  RandomLattice(&lat);
+  SoaLattice soa(lat);
+  KALDI_ASSERT(soa.Start() == lat.Start());
+  KALDI_ASSERT(soa.NumStates() == lat.NumStates());
+  for (StateId s = 0; s < lat.NumStates(); ++s) {
+    KALDI_ASSERT(soa.NumArcs(s) == lat.NumArcs(s));
+    KALDI_ASSERT(soa.Final(s) == lat.Final(s));
+  }
+  soa.ToLattice(&out);
+  KALDI_ASSERT(LatticesEqual(out, lat));
+
+  SoaLattice appended;
+  for (StateId end = 0; end < lat.NumStates(); ) {
+    end = std::min<StateId>(end + RandInt(1, 3), lat.NumStates());
+    appended.Append(lat, end);
+    KALDI_ASSERT(appended.NumStates() == end);
+  }
+  appended.ToLattice(&out);
+  KALDI_ASSERT(LatticesEqual(out, lat));
+
+  Lattice other;
+  RandomLattice(&other);
+  soa.Init(other);
+  soa.ToLattice(&out);
+  KALDI_ASSERT(LatticesEqual(out, other));
+}
+
+}  // namespace kaldi
+
+int main() {
+  using namespace kaldi;
+  for (int i = 0; i < 100; ++i) UnitTestSoaLatticeRoundTrip();
+  std::cout << "Test OK.\n";
+  return 0;
+}
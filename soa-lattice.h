@@ -0,0 +1,161 @@
+// MIT License
+//
+// Copyright (c) 2016 Joan Puigcerver <joapuipe@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef SOA_LATTICE_H_
+#define SOA_LATTICE_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "lat/kaldi-lattice.h"
+
+namespace kaldi {
+
+// Read-only lattice stored as a structure of arrays: the arcs of all the
+// states are contiguous (those of state s are in [ArcBegin(s), ArcEnd(s))),
+// with their input labels, output labels, next states and weights in separate
+// arrays. The passes over the arcs that only need some of their fields (e.g.
+// the output labels and next states, in the collapsers) touch less memory than
+// with the arcs of a VectorFst, and do not go through its per-state arc
+// vectors and iterators.
+//
+// The lattice can be built incrementally (see Append()), following a lattice
+// that is being extended.
+class SoaLattice {
+ public:
+  typedef LatticeArc::StateId StateId;
+  typedef LatticeArc::Label Label;
+
+  SoaLattice() : start_(fst::kNoStateId), arc_begin_(1, 0) {}
+
+  explicit SoaLattice(const Lattice& lat)
+      : start_(fst::kNoStateId), arc_begin_(1, 0) {
+    Init(lat);
+  }
+
+  void Init(const Lattice& lat) {
+    Clear();
+    Append(lat, lat.NumStates());
+  }
+
+  void Clear() {
+    start_ = fst::kNoStateId;
+    arc_begin_.assign(1, 0);
+    ilabels_.clear();
+    olabels_.clear();
+    nextstates_.clear();
+    graph_.clear();
+    acoustic_.clear();
+    final_.clear();
+  }
+
+  // Copy the states of lat from NumStates() to end - 1 (their arcs and final
+  // weights must be complete), and its start state.
+  void Append(const Lattice& lat, StateId end) {
+    start_ = lat.Start();
+    for (StateId s = NumStates(); s < end; ++s) {
+      for (fst::ArcIterator<Lattice> aiter(lat, s); !aiter.Done();
+           aiter.Next()) {
+        const LatticeArc& arc = aiter.Value();
+        ilabels_.push_back(arc.ilabel);
+        olabels_.push_back(arc.olabel);
+        nextstates_.push_back(arc.nextstate);
+        graph_.push_back(arc.weight.Value1());
+        acoustic_.push_back(arc.weight.Value2());
+      }
+      arc_begin_.push_back(olabels_.size());
+      final_.push_back(lat.Final(s));
+    }
+  }
+
+  void ToLattice(Lattice* lat) const {
+    lat->DeleteStates();
+    lat->ReserveStates(NumStates());
+    for (StateId s = 0; s < NumStates(); ++s) {
+      lat->AddState();
+      lat->SetFinal(s, final_[s]);
+      lat->ReserveArcs(s, NumArcs(s));
+      for (size_t a = ArcBegin(s); a < ArcEnd(s); ++a) lat->AddArc(s, Arc(a));
+    }
+    if (start_ != fst::kNoStateId) lat->SetStart(start_);
+  }
+
+  StateId Start() const { return start_; }
+  StateId NumStates() const { return arc_begin_.size() - 1; }
+  const LatticeWeight& Final(StateId s) const { return final_[s]; }
+  size_t NumArcs(StateId s) const { return arc_begin_[s + 1] - arc_begin_[s]; }
+  size_t ArcBegin(StateId s) const { return arc_begin_[s]; }
+  size_t ArcEnd(StateId s) const { return arc_begin_[s + 1]; }
+
+  Label ILabel(size_t a) const { return ilabels_[a]; }
+  Label OLabel(size_t a) const { return olabels_[a]; }
+  StateId NextState(size_t a) const { return nextstates_[a]; }
+  LatticeWeight Weight(size_t a) const {
+    return LatticeWeight(graph_[a], acoustic_[a]);
+  }
+  LatticeArc Arc(size_t a) const {
+    return LatticeArc(ilabels_[a], olabels_[a], Weight(a), nextstates_[a]);
+  }
+
+  // Output labels of all the arcs.
+  const std::vector<Label>& OLabels() const { return olabels_; }
+
+  // Whether all the states can reach a final state. The lattice must be
+  // topologically sorted.
+  bool IsCoAccessible() const {
+    std::vector<char> coaccessible(NumStates(), 0);
+    bool all = true;
+    for (StateId s = NumStates() - 1; s >= 0; --s) {
+      char c = (final_[s] != LatticeWeight::Zero());
+      for (size_t a = ArcBegin(s); a < ArcEnd(s) && !c; ++a)
+        c = coaccessible[nextstates_[a]];
+      coaccessible[s] = c;
+      all = all && c;
+    }
+    return all;
+  }
+
+  // Approximate memory (in bytes) used by the lattice.
+  size_t MemoryBytes() const {
+    return arc_begin_.size() * sizeof(size_t) +
+        final_.size() * sizeof(LatticeWeight) +
+        olabels_.size() * (2 * sizeof(Label) + sizeof(StateId) +
+                           2 * sizeof(float));
+  }
+
+ private:
+  StateId start_;
+  // First arc of each state (and the total number of arcs at the end).
+  std::vector<size_t> arc_begin_;
+  std::vector<Label> ilabels_;
+  std::vector<Label> olabels_;
+  std::vector<StateId> nextstates_;
+  // Graph and acoustic costs of the arcs.
+  std::vector<float> graph_;
+  std::vector<float> acoustic_;
+  std::vector<LatticeWeight> final_;
+};
+
+}  // namespace kaldi
+
+#endif  // SOA_LATTICE_H_